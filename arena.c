@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "arena.h"
+
+static size_t arena_round_up(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+size_t arena_aligned_size(size_t size) {
+    /* Space an allocation of size bytes takes from the arena */
+    return arena_round_up(size ? size : 1, ARENA_ALIGN);
+}
+
+static void *arena_chunk_data_alloc(size_t size, size_t align) {
+#ifdef WIN32
+    return _aligned_malloc(size, align);
+#else
+    void *p;
+    if (posix_memalign(&p, align, size))
+        return NULL;
+    return p;
+#endif
+}
+
+static void arena_chunk_data_free(void *p) {
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static arena_chunk *arena_chunk_create(size_t size) {
+    /* Large chunks are aligned to huge pages and the kernel is asked to back them with huge pages, if it can. Memory
+     * of chunks is zeroed once here, since it is never reused all allocations are zeroed too. */
+    size_t align = ARENA_ALIGN;
+    arena_chunk *chunk = malloc(sizeof(arena_chunk));
+    if (!chunk)
+        return NULL;
+    if (size >= ARENA_HUGEPAGE) {
+        align = ARENA_HUGEPAGE;
+        size = arena_round_up(size, ARENA_HUGEPAGE);
+    } else {
+        size = arena_round_up(size, ARENA_ALIGN);
+    }
+    chunk->data = arena_chunk_data_alloc(size, align);
+    if (!chunk->data) {
+        free(chunk);
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (align == ARENA_HUGEPAGE)
+        madvise(chunk->data, size, MADV_HUGEPAGE);
+#endif
+    memset(chunk->data, 0, size);
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = NULL;
+    return chunk;
+}
+
+arena *arena_create(size_t size) {
+    arena *a = malloc(sizeof(arena));
+    if (!a)
+        return NULL;
+    a->chunks = NULL;
+    a->allocated = 0;
+    a->used = 0;
+    if (arena_reserve(a, size)) {
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+int arena_reserve(arena *a, size_t size) {
+    /* Makes sure the next allocations totaling size bytes (including alignment) come from one chunk. The remaining
+     * space of the current chunk is abandoned if it is too small. */
+    arena_chunk *chunk;
+    if (a->chunks && a->chunks->size - a->chunks->used >= size)
+        return 0;
+    chunk = arena_chunk_create(size > ARENA_CHUNK_MIN ? size : ARENA_CHUNK_MIN);
+    if (!chunk)
+        return -1;
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    a->allocated += chunk->size;
+    return 0;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    void *p;
+    size = arena_aligned_size(size);
+    if (arena_reserve(a, size))
+        return NULL;
+    p = a->chunks->data + a->chunks->used;
+    a->chunks->used += size;
+    a->used += size;
+    return p;
+}
+
+void *arena_calloc(arena *a, size_t n, size_t size) {
+    if (size && n > (size_t) -1 / size)
+        return NULL;
+    return arena_alloc(a, n * size);
+}
+
+void arena_free(arena *a) {
+    arena_chunk *chunk, *next;
+    if (!a)
+        return;
+    for (chunk = a->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        arena_chunk_data_free(chunk->data);
+        free(chunk);
+    }
+    free(a);
+}
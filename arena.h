@@ -0,0 +1,29 @@
+#ifndef ERD_DEPTH_ARENA_H
+#define ERD_DEPTH_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN (64) /* Every allocation starts on a cache line */
+#define ARENA_CHUNK_MIN (1024*1024) /* Smallest chunk allocated when the arena runs out of space */
+#define ARENA_HUGEPAGE (2*1024*1024) /* Chunks at least this large are aligned to (transparent) huge pages */
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    char *data;
+    size_t size;
+    size_t used;
+} arena_chunk;
+
+typedef struct arena {
+    arena_chunk *chunks; /* Newest chunk first, allocations are only made from the newest one */
+    size_t allocated; /* Total size of chunks */
+    size_t used; /* Total size of allocations, including alignment */
+} arena;
+
+arena *arena_create(size_t size);
+int arena_reserve(arena *a, size_t size);
+size_t arena_aligned_size(size_t size);
+void *arena_alloc(arena *a, size_t size);
+void *arena_calloc(arena *a, size_t n, size_t size);
+void arena_free(arena *a);
+#endif // ERD_DEPTH_ARENA_H
@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#if (defined(HAVE_ZLIB) || defined(HAVE_ZSTD)) && !defined(WIN32)
+#define DECOMPRESS_THREAD
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE is used instead */
+#endif
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "decompress.h"
+
+compression_type compression_detect(const unsigned char *magic, size_t n) {
+    if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if(n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+compression_type compression_file_type(const char *filename) { /* Files that can't be opened are not compressed */
+    unsigned char magic[DECOMPRESS_MAGIC_LEN];
+    FILE *f = fopen(filename, "rb");
+    if(!f) {
+        return COMPRESSION_NONE;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+    return compression_detect(magic, n);
+}
+
+const char *compression_name(compression_type type) {
+    switch(type) {
+        case COMPRESSION_GZIP:
+            return "gzip";
+        case COMPRESSION_ZSTD:
+            return "zstd";
+        case COMPRESSION_NONE:
+        default:
+            return "uncompressed";
+    }
+}
+
+int compression_supported(compression_type type) { /* Uncompressed input that can't be rewound also needs the thread */
+    switch(type) {
+#ifdef DECOMPRESS_THREAD
+        case COMPRESSION_NONE:
+            return 1;
+#endif
+#if defined(DECOMPRESS_THREAD) && defined(HAVE_ZLIB)
+        case COMPRESSION_GZIP:
+            return 1;
+#endif
+#if defined(DECOMPRESS_THREAD) && defined(HAVE_ZSTD)
+        case COMPRESSION_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+#ifdef DECOMPRESS_THREAD
+typedef struct decompressor {
+    struct decompressor *next;
+    FILE *in;
+    FILE *out; /* Read end of a socket pair, given to the caller */
+    int fd; /* Write end, the thread writes decompressed data here */
+    compression_type type;
+    unsigned char magic[DECOMPRESS_MAGIC_LEN]; /* Bytes already read from in, they are decompressed first */
+    size_t n_magic;
+    int close_in; /* in was opened by decompress_fopen() */
+    int error;
+    pthread_t thread;
+} decompressor;
+
+static decompressor *decompressors = NULL; /* Running decompressors, decompress_fclose() finds them here */
+static pthread_mutex_t decompressors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t decompress_read(decompressor *d, unsigned char *buf, size_t n) {
+    size_t k = d->n_magic < n ? d->n_magic : n;
+    memcpy(buf, d->magic, k);
+    memmove(d->magic, d->magic + k, d->n_magic - k);
+    d->n_magic -= k;
+    return k + fread(buf + k, 1, n - k, d->in);
+}
+
+static int decompress_write(decompressor *d, const unsigned char *buf, size_t n) {
+    /* Returns -1 when the reader has closed the stream. That is not an error, the reader just didn't need the rest.
+     * A socket is used instead of a pipe, since it can be written without getting SIGPIPE. */
+    while(n) {
+        ssize_t k = send(d->fd, buf, n, MSG_NOSIGNAL);
+        if(k < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static int decompress_copy(decompressor *d, unsigned char *buf) {
+    size_t n;
+    while((n = decompress_read(d, buf, DECOMPRESS_CHUNK)) > 0) {
+        if(decompress_write(d, buf, n)) {
+            return 0;
+        }
+    }
+    return ferror(d->in) ? -1 : 0;
+}
+
+#ifdef HAVE_ZLIB
+static int decompress_gzip(decompressor *d, unsigned char *in, unsigned char *out) {
+    /* Concatenated gzip members (e.g. from pigz or cat) are decompressed one after another */
+    z_stream z;
+    int ret, ended = 0;
+    memset(&z, 0, sizeof(z));
+    if(inflateInit2(&z, 15 + 32) != Z_OK) { /* 32: detect gzip or zlib header */
+        return -1;
+    }
+    while(1) {
+        if(z.avail_in == 0) {
+            z.avail_in = decompress_read(d, in, DECOMPRESS_CHUNK);
+            z.next_in = in;
+            if(z.avail_in == 0) {
+                break;
+            }
+        }
+        z.next_out = out;
+        z.avail_out = DECOMPRESS_CHUNK;
+        ret = inflate(&z, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            inflateEnd(&z);
+            return -1;
+        }
+        ended = (ret == Z_STREAM_END);
+        if(decompress_write(d, out, DECOMPRESS_CHUNK - z.avail_out)) {
+            inflateEnd(&z);
+            return 0;
+        }
+        if(ended) {
+            inflateReset(&z);
+        }
+    }
+    inflateEnd(&z);
+    return ended && !ferror(d->in) ? 0 : -1; /* Not ended: truncated file */
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd(decompressor *d, unsigned char *in, unsigned char *out) {
+    ZSTD_DStream *z = ZSTD_createDStream();
+    size_t n, ret = 1;
+    int full;
+    if(!z) {
+        return -1;
+    }
+    ZSTD_initDStream(z);
+    while((n = decompress_read(d, in, DECOMPRESS_CHUNK)) > 0) {
+        ZSTD_inBuffer input = {in, n, 0};
+        do { /* Until all input is consumed and there is no more output pending */
+            ZSTD_outBuffer output = {out, DECOMPRESS_CHUNK, 0};
+            ret = ZSTD_decompressStream(z, &output, &input);
+            if(ZSTD_isError(ret)) {
+                ZSTD_freeDStream(z);
+                return -1;
+            }
+            if(decompress_write(d, out, output.pos)) {
+                ZSTD_freeDStream(z);
+                return 0;
+            }
+            full = (output.pos == output.size);
+        } while(input.pos < input.size || full);
+    }
+    ZSTD_freeDStream(z);
+    return ret == 0 && !ferror(d->in) ? 0 : -1; /* ret is zero at the end of a frame */
+}
+#endif
+
+static void *decompress_thread(void *arg) {
+    decompressor *d = arg;
+    unsigned char *in = malloc(DECOMPRESS_CHUNK), *out = malloc(DECOMPRESS_CHUNK);
+    if(!in || !out) {
+        d->error = -1;
+    } else {
+        switch(d->type) {
+#ifdef HAVE_ZLIB
+            case COMPRESSION_GZIP:
+                d->error = decompress_gzip(d, in, out);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case COMPRESSION_ZSTD:
+                d->error = decompress_zstd(d, in, out);
+                break;
+#endif
+            default:
+                d->error = decompress_copy(d, in);
+                break;
+        }
+    }
+    if(d->error) {
+        fprintf(stderr, "Error in reading %s input, data is incomplete.\n", compression_name(d->type));
+    }
+    free(in);
+    free(out);
+    close(d->fd); /* Reader gets end of file */
+    return NULL;
+}
+
+static FILE *decompress_thread_start(FILE *in, compression_type type, const unsigned char *magic, size_t n_magic, int close_in) {
+    int fds[2];
+    decompressor *d = calloc(1, sizeof(decompressor));
+    if(!d) {
+        return NULL;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        free(d);
+        return NULL;
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    d->in = in;
+    d->fd = fds[1];
+    d->type = type;
+    memcpy(d->magic, magic, n_magic);
+    d->n_magic = n_magic;
+    d->close_in = close_in;
+    d->out = fdopen(fds[0], "r");
+    if(!d->out || pthread_create(&d->thread, NULL, decompress_thread, d)) {
+        if(d->out) {
+            fclose(d->out);
+        } else {
+            close(fds[0]);
+        }
+        close(fds[1]);
+        free(d);
+        return NULL;
+    }
+    pthread_mutex_lock(&decompressors_lock);
+    d->next = decompressors;
+    decompressors = d;
+    pthread_mutex_unlock(&decompressors_lock);
+    return d->out;
+}
+#endif
+
+static FILE *decompress_start(FILE *in, int close_in) {
+    /* Only the first byte is peeked (and pushed back) unless it could start a compressed stream, so ordinary text input
+     * is read directly, also from pipes. */
+    unsigned char magic[DECOMPRESS_MAGIC_LEN];
+    long pos = ftell(in);
+    int c = getc(in);
+    if(c == EOF) {
+        return in;
+    }
+    ungetc(c, in);
+    if(c != 0x1f && c != 0x28) {
+        return in;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), in);
+    compression_type type = compression_detect(magic, n);
+    if(type == COMPRESSION_NONE && pos >= 0 && fseek(in, pos, SEEK_SET) == 0) {
+        return in;
+    }
+    if(!compression_supported(type)) {
+        fprintf(stderr, "Input is %s, this is not supported by this build.\n", type == COMPRESSION_NONE ? "not seekable" : compression_name(type));
+        if(close_in) {
+            fclose(in);
+        }
+        return NULL;
+    }
+#ifdef DECOMPRESS_THREAD
+    FILE *out = decompress_thread_start(in, type, magic, n, close_in);
+    if(!out) {
+        fprintf(stderr, "Could not start decompression of %s input.\n", compression_name(type));
+        if(close_in) {
+            fclose(in);
+        }
+    }
+    return out;
+#else
+    return NULL;
+#endif
+}
+
+FILE *decompress_fopen(const char *filename) { /* Like fopen(filename, "r"), but compressed files are decompressed */
+    FILE *in = fopen(filename, "r");
+    if(!in) {
+        return NULL;
+    }
+    return decompress_start(in, 1);
+}
+
+FILE *decompress_stream(FILE *in) {
+    /* Returns in itself if it isn't compressed, otherwise a stream of decompressed data. Decompression runs on a thread
+     * of its own. Close the returned stream with decompress_fclose(), which doesn't close in. */
+    return decompress_start(in, 0);
+}
+
+int decompress_fclose(FILE *f) { /* Returns non-zero if decompression failed (or fclose() did) */
+#ifdef DECOMPRESS_THREAD
+    decompressor *d = NULL, **p;
+    pthread_mutex_lock(&decompressors_lock);
+    for(p = &decompressors; *p; p = &(*p)->next) {
+        if((*p)->out == f) {
+            d = *p;
+            *p = d->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&decompressors_lock);
+    if(d) {
+        int error;
+        fclose(d->out); /* If the thread is still writing, it stops */
+        pthread_join(d->thread, NULL);
+        if(d->close_in) {
+            fclose(d->in);
+        }
+        error = d->error;
+        free(d);
+        return error;
+    }
+#endif
+    return fclose(f);
+}
@@ -0,0 +1,22 @@
+#ifndef ERD_DEPTH_DECOMPRESS_H
+#define ERD_DEPTH_DECOMPRESS_H
+
+#include <stdio.h>
+
+#define DECOMPRESS_MAGIC_LEN (4) /* Bytes needed to detect the compression */
+#define DECOMPRESS_CHUNK (256*1024) /* Size of input and output buffers of the decompression thread */
+
+typedef enum compression_type {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_GZIP = 1,
+    COMPRESSION_ZSTD = 2
+} compression_type;
+
+compression_type compression_detect(const unsigned char *magic, size_t n);
+compression_type compression_file_type(const char *filename);
+const char *compression_name(compression_type type);
+int compression_supported(compression_type type);
+FILE *decompress_fopen(const char *filename);
+FILE *decompress_stream(FILE *in);
+int decompress_fclose(FILE *f);
+#endif // ERD_DEPTH_DECOMPRESS_H
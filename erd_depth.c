@@ -3,29 +3,44 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
-
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #include <jibal.h>
 #include <jibal_stop.h>
 #include <jibal_gsto.h>
 #include <jibal_cs.h>
 
+#include "arena.h"
+#include "decompress.h"
+#include "profiles.h"
+#include "erd_depth.h"
+
 #define NLINE 200
-#define NAMELEN 1000 /* This is the maximum length for a filename. FIXME: Dynamic length! */
 #define NELESYM 10
 #define MAXELEMENTS 100 /* Default for general->maxelements */
-#define MAXNUCMASSES 300 /* Default for general->maxnucmasses */
-#define ERD 1
-#define RBS 2
-#define MAXEVENTS 10000000
+#define MAXEVENTS 1000000000 /* Events are stored in a growing table, up to this many */
+#define EVENTS_INITIAL_ALLOC (65536)
 #define MAXVSTEP 201
 #define MAXDSTEP 201 /* Default for general->maxdstep */
 #define MAXSTOCHANGE 0.02
-#define PARALLEL_EVENTS (5000)
+#define VSTEPS_MIN 65 /* Smallest velocity table, tables are grown by doubling number of intervals */
+#define VSTEPS_MAX 16385
+#define VSTEPS_FIXED 1001 /* Velocity steps when interpolation tolerance is zero */
+#define STO_TOLERANCE 0.0 /* Default is the fixed grid of VSTEPS_FIXED steps, e.g. 1e-4 gives adaptive tables */
+#define STO_FLOAT_UNIT (C_EV_TFU) /* Stopping in SI units is too close to FLT_MIN, single precision tables are scaled */
+#define PARALLEL_EVENTS (500) /* Chunk size for dynamic scheduling of the (cost sorted) event loop */
+#define REDUCTION_BLOCK (16384) /* Events per partial sum in histogram reductions, independent of number of threads */
+#define REDUCTION_WAVE (32) /* Number of partial sums kept in memory at a time */
+#define HISTOGRAM_CHUNK (REDUCTION_BLOCK * REDUCTION_WAVE) /* Events binned at a time */
 
 
-#define TRUE  1
-#define FALSE 0
 
 #define TYPELEN 3
 
@@ -40,9 +55,37 @@
 #define I_CROSS_SECTION 8
 #define I_MAXDSTEP 9
 #define I_NITER 10
+#define I_ORDER 11
+#define I_INTEGRATOR 12
+#define I_TOLERANCE 13
+#define I_DEPTHGRID 14
+#define I_STOTOLERANCE 15
+#define I_PRECISION 16
+#define I_COMPACT 17
+#define I_MEMLIMIT 18
+#define I_OUTFORMAT 19
+#define I_SAVEDEPTHS 20
+#define I_SWEEP_DENSITY 21
+#define I_SWEEP_TARANGLE 22
+#define I_SWEEP_DETOFFSET 23
+#define I_SWEEP_CROSS_SECTION 24
 
 #define F_MASSES DATAPATH/masses.dat
 #define NITER 4
+#define ELOSS_TOLERANCE (0.1*C_KEV) /* Default energy error per step of adaptive energy loss integrators */
+
+#define ORDER_EBINS 256 /* Number of energy bins in locality ordering of events */
+
+#define GRID_SURFACE 3.0 /* Refinement of the adaptive depth grid at the surface */
+#define GRID_SURFACE_DEPTH 10.0 /* Depth (in nominal depth steps) of the surface refinement */
+#define GRID_GRADIENT 10.0 /* Refinement of the adaptive depth grid per change of concentration per nominal step */
+#define GRID_MAXREFINE 8.0 /* Maximum ratio of nominal step to the finest step */
+
+#define DEPTHS_MAGIC "ERDDEPT1" /* First bytes of a saved depths file */
+#define DEPTHS_MAGIC_LEN (8)
+#define DEPTHS_BYTE_ORDER (0x01020304) /* Saved depths are read on machines of the same byte order only */
+#define DEPTHS_EXTENSION ".depths"
+#define DEPTHS_CHUNK (65536) /* Events written or read at a time */
 
 #define NABOVE 20    /* Output steps above the surface */
 #define WSCALE 4.0   /* change of the total conc (sigma) to stop scaling */
@@ -64,141 +107,29 @@ static const char *inlines[] = {
         "Depths for concentration scaling:",
         "Cross section:",
         "Number of depth steps:",
-        "Number of iterations:"
+        "Number of iterations:",
+        "Event ordering:",
+        "Energy loss integrator:",
+        "Energy loss tolerance:",
+        "Depth grid:",
+        "Stopping interpolation tolerance:",
+        "Single precision:",
+        "Compact events:",
+        "Memory limit:",
+        "Output format:",
+        "Save event depths:",
+        "Sweep target density:",
+        "Sweep target angle:",
+        "Sweep detector angle offset:",
+        "Sweep cross section:"
 };
 
-enum cross_section {
-    CS_NONE = 0,
-    CS_RUTHERFORD = 1,
-    CS_LECUYER = 2,
-    CS_ANDERSEN = 3
-};
-
-typedef struct {
-    double theta;
-    double fii;
-    double E;
-    double v;
-    int type;
-    int n;
-    int Z;
-    int A;
-    double M;
-    double w0;
-    double w;
-    double d;
-    int id;
-} Event;
-
-typedef struct {
-    int Z;
-    int A;
-    double M;
-    double E;
-    double detector_angle;
-    double target_angle;
-} Measurement;
-
-typedef struct {
-    jibal *jibal;
-    char eventfile[NAMELEN];
-    char setupfile[NAMELEN];
-    int nevents;
-    double vmax;
-    int *element; /* element[0..maxelements] */
-    int **nuclide; /* nuclide[0..maxelements][0..maxnucmasses] */
-    char prefix[NAMELEN];
-    double *M; /* M[0..maxelements] */
-    double outstep;
-    double minscale, maxscale;
-    int scale;
-    enum cross_section cs;
-    int maxdstep;
-    int maxelements;
-    int maxnucmasses;
-    int niter;
-} General;
-
-typedef struct {
-    double vstep;
-    int vsteps;
-    double dstep;
-    double vdiv;
-    double ddiv;
-    double ***ele; /* ele[0..maxelements][0..maxelements] */
-    double ***sum; /* sum[0..maxelements] */
-} Stopping;
-
-typedef struct {
-    double dstep;
-    double dmax;
-    double **w; /* w[0..maxelements][0..maxdstep] */
-    int **n; /* n[0..maxelements][0..maxdstep] */
-    double *wsum; /* wsum[0..maxdstep] */
-    double *mass; /* wsum[0..maxdstep] */
-    int *nsum; /* wsum[0..maxdstep] */
-    double *Ebeam;
-    double density;
-    double ***wprofile; /* wprofile[0..maxelements][0..maxnucmasses] */
-    int ***nprofile; /* nprofile[0..maxelements][0..maxnucmasses] */
-    double *wprofsum;
-    double *profmass;
-    int *nprofsum;
-} Concentration;
-
-void read_command_line(int, char **, General *);
-void read_setup(General *, Measurement *, Concentration *);
-void read_events(General *, Measurement *, Event *, Concentration *);
-char *read_inputline(char *, int);
-void file_error(char *, int);
-double ipow(double, int);
-void calculate_stoppings(General *, Measurement *, Stopping *);
-void create_sumsto(void);
-void create_conc_profile(General *, Measurement *, Stopping *,
-                         Concentration *);
-void calculate_primary_energy(General *, Measurement *, Stopping *,
-                              Concentration *);
-double get_eloss(General *, int, double, double, double, double, Stopping *);
-double inter_sto(General *, int, double, double, Stopping *);
-void calculate_recoil_depths(General *, Measurement *, Event *,
-                             Stopping *, Concentration *);
-void output(General *, Concentration *, Event *);
-void clear_conc(General *, Concentration *);
-char *get_symbol(int);
-double Lecuyer(int, int, double);
-double Andersen(int, int, double, double);
-double Serd(int, double, int, double, double, double, enum cross_section);
-double Srbs(int, double, int, double, double, double, enum cross_section);
-double Srbs_mc(double, double, double, double);
-double mc2lab_scatc(double, double, double);
-int allocate_general_sto_conc(General *, Measurement *, Stopping *, Concentration *);
-
 extern inline double ipow2(double x) {
     return (x * x);
 }
 
-
-int main(int argc, char *argv[]) {
-    General general;
-    Stopping sto;
-    Concentration conc;
-    Event *event;
-    Measurement meas;
-    int i;
-    for (i = 0; i < argc; i++) {
-        fprintf(stderr, "%s%s", argv[i], i < argc - 1 ? " " : "\n");
-    }
-    general.jibal = jibal_init(NULL);
-    if (general.jibal->error) {
-        fprintf(stderr, "Initializing JIBAL failed with error code: %i (%s)\n", general.jibal->error,
-                jibal_error_string(general.jibal->error));
-        return EXIT_FAILURE;
-    }
-    event = (Event *) malloc(MAXEVENTS * sizeof(Event));
-    read_command_line(argc, argv, &general);
-    read_setup(&general, &meas, &conc);
-    allocate_general_sto_conc(&general, &meas, &sto, &conc);
-    switch (general.cs) {
+void print_settings(General *general) {
+    switch (general->cs) {
         default:
         case CS_RUTHERFORD:
             fprintf(stderr, "erd_depth is using Rutherford cross sections\n");
@@ -210,125 +141,483 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "erd_depth is using Andersen corrected Rutherford cross sections\n");
             break;
     }
-    clear_conc(&general, &conc);
-    read_events(&general, &meas, event, &conc);
-    calculate_stoppings(&general, &meas, &sto);
-    create_conc_profile(&general, &meas, &sto, &conc);
-    for (i = 0; i < general.niter; i++) {
-        calculate_primary_energy(&general, &meas, &sto, &conc);
-        clear_conc(&general, &conc);
-        calculate_recoil_depths(&general, &meas, event, &sto, &conc);
-        create_conc_profile(&general, &meas, &sto, &conc);
+    switch (general->integrator) {
+        default:
+        case INTEGRATOR_TRAPEZOID:
+            fprintf(stderr, "erd_depth is using trapezoid rule for energy loss\n");
+            break;
+        case INTEGRATOR_RK23:
+            fprintf(stderr, "erd_depth is using adaptive RK23 for energy loss, tolerance %g keV\n",
+                    general->eloss_tolerance / C_KEV);
+            break;
+    }
+    switch (general->ordering) {
+        default:
+        case ORDER_COST:
+            fprintf(stderr, "erd_depth is processing events in order of cost\n");
+            break;
+        case ORDER_LOCALITY:
+            fprintf(stderr, "erd_depth is processing events in order of type, element and energy\n");
+            break;
+    }
+    switch (general->precision) {
+        default:
+        case PRECISION_DOUBLE:
+            break;
+        case PRECISION_SINGLE:
+            fprintf(stderr, "erd_depth is using single precision stopping tables\n");
+            break;
+        case PRECISION_COMPARE:
+            fprintf(stderr, "erd_depth is comparing single and double precision stopping tables\n");
+            break;
+    }
+    if (general->memlimit > 0.0)
+        fprintf(stderr, "erd_depth is streaming events from disk in compact form if they take more than %.1lf MB "
+                        "(events only, not counting histograms)\n", general->memlimit / 1.0e6);
+    if (general->compact)
+        fprintf(stderr, "erd_depth is storing events in compact form (single precision, the mass of each event is the "
+                        "mass of the first event of the same Z and A)\n");
+    if (general->noutsteps > 1) {
+        fprintf(stderr, "erd_depth is writing profiles with output steps");
+        for (int k = 0; k < general->noutsteps; k++)
+            fprintf(stderr, " %g", general->outsteps[k] / C_TFU);
+        fprintf(stderr, " tfu to files %s_<step>.*\n", general->prefix);
     }
+    if (general->outformat != OUTPUT_TEXT)
+        fprintf(stderr, "erd_depth is writing profiles to binary file %s%s\n", general->prefix, PROFILES_EXTENSION);
+    if (general->rebin)
+        fprintf(stderr, "erd_depth is making profiles from saved depths in %s\n", general->eventfile);
+    if (general->sweep.active) {
+        fprintf(stderr, "erd_depth is sweeping parameters, summary is written to %s.sweep\n", general->prefix);
+        if (general->savedepths)
+            fprintf(stderr, "erd_depth is not saving event depths in a sweep\n");
+    } else if (general->savedepths && !general->rebin)
+        fprintf(stderr, "erd_depth is saving event depths to file %s%s\n", general->prefix, DEPTHS_EXTENSION);
+}
 
-    output(&general, &conc, event);
-    jibal_free(general.jibal);
-    exit(0);
+void events_init(General *general, Events *events) {
+    events->compact = general->compact;
+    events->spill = FALSE;
+    events->nalloc = 0;
+    events->event = NULL;
+    events->cevent = NULL;
+    events->spillfile = NULL;
 }
 
-int allocate_general_sto_conc(General *general, Measurement *meas, Stopping *sto, Concentration *conc) {
+void analyze_events(General *general, Measurement *meas, Events *events, Stopping *sto, Concentration *conc) {
+    /* Everything between reading the events and output */
+    if (general->ordering == ORDER_LOCALITY && general->order)
+        order_events_by_locality(general, events);
+    calculate_stoppings(general, meas, sto);
+    solve_depths(general, meas, events, sto, conc);
+}
+
+void solve_depths(General *general, Measurement *meas, Events *events, Stopping *sto, Concentration *conc) {
+    /* Depths of events with stopping tables of the chosen precision, or both precisions when comparing */
     int i;
-    fprintf(stderr, "Allocating stuff. %i %i %i\n", general->maxelements, general->maxnucmasses, general->maxdstep);
-    /* TODO: this is horrible allocation hell, originally these were statically allocated, but this isn't exactly pretty */
-    general->element = (int *) calloc(general->maxelements, sizeof(int));
-    general->element[meas->Z]++;
-    general->nuclide = (int **) calloc(general->maxelements, sizeof(int *));
-    general->M = (double *) calloc(general->maxelements, sizeof(double));
-    sto->ele = (double ***) calloc(general->maxelements, sizeof(double **));
-    sto->sum = (double ***) calloc(general->maxelements, sizeof(double **));
-    conc->w = (double **) calloc(general->maxelements, sizeof(double *));
-    conc->n = (int **) calloc(general->maxelements, sizeof(int *));
-    conc->wsum = (double *) calloc(general->maxdstep, sizeof(double));
-    conc->mass = (double *) calloc(general->maxdstep, sizeof(double));
-    conc->nsum = (int *) calloc(general->maxdstep, sizeof(int));
-    conc->Ebeam = (double *) calloc(general->maxdstep, sizeof(double));
-    conc->wprofile = (double ***) calloc(general->maxelements * general->maxnucmasses, sizeof(double **));
-    conc->nprofile = (int ***) calloc(general->maxelements, sizeof(int **));
-    for (i = 0; i < general->maxelements; i++) {
-        general->nuclide[i] = (int *) calloc(general->maxnucmasses, sizeof(int));
-        sto->ele[i] = (double **) calloc(general->maxelements, sizeof(double *));
-        conc->w[i] = (double *) calloc(general->maxdstep, sizeof(double));
-        conc->n[i] = (int *) calloc(general->maxdstep, sizeof(int));
-        conc->wprofile[i] = (double **) calloc(general->maxnucmasses, sizeof(double *));
-        conc->nprofile[i] = (int **) calloc(general->maxnucmasses, sizeof(int *));
-    }
-    if (general->element && general->nuclide && general->M && sto->ele && sto->sum) {
-        return 0;
+    if (general->precision == PRECISION_COMPARE) {
+        int n = general->maxelements * general->maxdstep;
+        double *w = (double *) malloc(sizeof(double) * n), *d = (double *) malloc(sizeof(double) * max(general->nevents, 1));
+        double dw = 0.0, dd = 0.0;
+        sto->single = TRUE;
+        calculate_depths(general, meas, events, sto, conc);
+        memcpy(w, conc->w[0], sizeof(double) * n);
+        for (i = 0; i < general->nevents; i++)
+            d[i] = event_w(events, i) > 0.0 ? event_d(events, i) : 0.0;
+        sto->single = FALSE;
+        calculate_depths(general, meas, events, sto, conc);
+        for (i = 0; i < n; i++)
+            dw = max(dw, fabs(w[i] - conc->w[0][i]));
+        for (i = 0; i < general->nevents; i++) {
+            if (event_w(events, i) > 0.0)
+                dd = max(dd, fabs(d[i] - event_d(events, i)));
+        }
+        fprintf(stderr, "Single precision: maximum difference to double precision %.3e in concentration, %.3e tfu in depth\n",
+                dw, dd / C_TFU);
+        free(w);
+        free(d);
     } else {
-        fprintf(stderr, "Could not allocate general tables etc.\n");
-        exit(9);
+        sto->single = (general->precision == PRECISION_SINGLE);
+        calculate_depths(general, meas, events, sto, conc);
     }
+    if (general->savedepths)
+        save_depths(general, conc, events);
 }
 
-void output(General *general, Concentration *conc, Event *event) {
+void sweep(General *general, Measurement *meas, Events *events, Stopping *sto, Concentration *conc) {
+    /* Depths and profiles at every point of the parameter grid (all combinations of the values of each parameter).
+     * Events are read and stopping tables are calculated once. The points are evaluated one after another, each with
+     * all threads, since the depth calculation changes the events. Points that differ only in density share the
+     * depths. Profiles of point i are written with prefix
+     * <prefix>_p<i>, the areal densities of all nuclides at each point to <prefix>.sweep. Event depths are not saved. */
+    SweepGrid *grid = &general->sweep;
+    char prefix[NAMELEN], fname[NAMELEN];
+    double density = conc->density, target_angle = meas->target_angle, offset = meas->detector_offset, *amount;
+    enum cross_section cs = general->cs;
+    int savedepths = general->savedepths;
+    int i, k, inuc, npoints = 1, idx[SWEEP_AXES];
     FILE *fp;
-    char fname[NAMELEN], fnuc[NAMELEN];
-    double max_change, nominal, wsum = 0.0, dep, dep0, mdep, mdep0, d, r, relerr;
-    int iz2, ia2, ie, z, a, ip, id, nprofile, minp, maxp;
-
-    r = general->outstep / conc->dstep;
-
-    nprofile = (general->maxdstep * conc->dstep) / general->outstep + NABOVE;
-
-    for (iz2 = 1; iz2 < general->maxelements; iz2++) {
-        if (general->element[iz2] > 0) {
-            for (ia2 = 1; ia2 < general->maxnucmasses; ia2++) {
-                if (general->nuclide[iz2][ia2]) {
-                    conc->wprofile[iz2][ia2] = (double *) malloc(sizeof(double) * nprofile);
-                    conc->nprofile[iz2][ia2] = (int *) malloc(sizeof(int) * nprofile);
-                    for (ip = 0; ip < nprofile; ip++) {
-                        conc->wprofile[iz2][ia2][ip] = 0.0;
-                        conc->nprofile[iz2][ia2][ip] = 0;
-                    }
-                }
+
+    for (k = 0; k < SWEEP_AXES; k++) { /* Parameters without a sweep have only the value of the setup */
+        if (grid->n[k] == 0) {
+            grid->n[k] = 1;
+            grid->value[k][0] = (k == SWEEP_DENSITY) ? density : (k == SWEEP_TARGET_ANGLE) ? target_angle :
+                                (k == SWEEP_CROSS_SECTION) ? cs : offset;
+        }
+        npoints *= grid->n[k];
+    }
+    strcpy(prefix, general->prefix);
+    if (snprintf(fname, NAMELEN, "%s.sweep", prefix) >= NAMELEN) {
+        fprintf(stderr, "Output prefix %s is too long\n", prefix);
+        exit(6);
+    }
+    fp = fopen(fname, "w");
+    amount = (double *) malloc(sizeof(double) * max(general->nnuclides, 1));
+    if (fp == NULL || amount == NULL) {
+        fprintf(stderr, "Could not open file %s for writing\n", fname);
+        exit(6);
+    }
+    fprintf(fp, "#point density  tangle   offset cs");
+    for (inuc = 0; inuc < general->nnuclides; inuc++) {
+        char name[NAMELEN];
+        sprintf(name, "%i%s", general->nuclide[inuc].A, general->jibal->elements[general->nuclide[inuc].Z].name);
+        fprintf(fp, " %12s", name);
+    }
+    fprintf(fp, "\n");
+
+    if (general->ordering == ORDER_LOCALITY && general->order)
+        order_events_by_locality(general, events);
+    calculate_stoppings(general, meas, sto);
+    general->savedepths = FALSE;
+    for (i = 0; i < npoints; i++) {
+        for (k = 0; k < SWEEP_AXES; k++) { /* Last parameter changes fastest */
+            int rest = 1;
+            for (int kk = k + 1; kk < SWEEP_AXES; kk++)
+                rest *= grid->n[kk];
+            idx[k] = (i / rest) % grid->n[k];
+        }
+        conc->density = grid->value[SWEEP_DENSITY][idx[SWEEP_DENSITY]];
+        meas->target_angle = grid->value[SWEEP_TARGET_ANGLE][idx[SWEEP_TARGET_ANGLE]];
+        meas->detector_offset = grid->value[SWEEP_DETECTOR_OFFSET][idx[SWEEP_DETECTOR_OFFSET]];
+        general->cs = (enum cross_section) grid->value[SWEEP_CROSS_SECTION][idx[SWEEP_CROSS_SECTION]];
+        fprintf(stderr, "Sweep point %i/%i: density %g g/cm3, target angle %g deg, detector angle offset %g deg, "
+                        "cross section %i\n", i + 1, npoints, conc->density / C_G_CM3, meas->target_angle / C_DEG,
+                meas->detector_offset / C_DEG, general->cs);
+        if (snprintf(general->prefix, NAMELEN, "%s_p%i", prefix, i) >= NAMELEN - 20) { /* Room for suffixes */
+            fprintf(stderr, "Output prefix %s is too long\n", prefix);
+            exit(6);
+        }
+        if (idx[SWEEP_DENSITY] == 0)
+            solve_depths(general, meas, events, sto, conc);
+        output(general, conc, events, amount);
+        fprintf(fp, "%6i %7.4f %7.3f %8.4f %2i", i, conc->density / C_G_CM3, meas->target_angle / C_DEG,
+                meas->detector_offset / C_DEG, general->cs);
+        for (inuc = 0; inuc < general->nnuclides; inuc++)
+            fprintf(fp, " %12.4f", amount[inuc]);
+        fprintf(fp, "\n");
+        fflush(fp);
+    }
+    fclose(fp);
+    free(amount);
+    strcpy(general->prefix, prefix);
+    conc->density = density;
+    meas->target_angle = target_angle;
+    meas->detector_offset = offset;
+    general->cs = cs;
+    general->savedepths = savedepths;
+}
+
+void save_depths(General *general, Concentration *conc, Events *events) {
+    /* Writes the final depths and weights of events to <prefix>.depths. The file has a header (DEPTHS_MAGIC, byte
+     * order, number of events and target density in SI units) followed by one SavedEvent for each event. */
+    FILE *fp;
+    char fname[NAMELEN];
+    int32_t head[2] = {DEPTHS_BYTE_ORDER, general->nevents};
+    SavedEvent *buf;
+    int i, k, n;
+
+    if (snprintf(fname, NAMELEN, "%s%s", general->prefix, DEPTHS_EXTENSION) >= NAMELEN) {
+        fprintf(stderr, "Output prefix %s is too long\n", general->prefix);
+        exit(6);
+    }
+    fp = fopen(fname, "wb");
+    buf = (SavedEvent *) malloc(sizeof(SavedEvent) * DEPTHS_CHUNK);
+    if (fp == NULL || buf == NULL) {
+        fprintf(stderr, "Could not open file %s for writing\n", fname);
+        exit(6);
+    }
+    fprintf(stderr, "Writing event depths to file %s\n", fname);
+    fwrite(DEPTHS_MAGIC, 1, DEPTHS_MAGIC_LEN, fp);
+    fwrite(head, sizeof(int32_t), 2, fp);
+    fwrite(&conc->density, sizeof(double), 1, fp);
+    for (i = 0; i < general->nevents; i += n) {
+        n = min(DEPTHS_CHUNK, general->nevents - i);
+        for (k = 0; k < n; k++) {
+            buf[k].Z = event_Z(events, i + k);
+            buf[k].A = general->nuclide[event_nuc(events, i + k)].A;
+            buf[k].M = event_M(events, i + k);
+            buf[k].d = event_d(events, i + k);
+            buf[k].w = event_w(events, i + k);
+        }
+        fwrite(buf, sizeof(SavedEvent), n, fp);
+    }
+    free(buf);
+    if (ferror(fp) | fclose(fp)) {
+        fprintf(stderr, "Could not write file %s\n", fname);
+        exit(6);
+    }
+}
+
+void read_depths(General *general, Measurement *meas, Events *events, Concentration *conc) {
+    /* Reads events saved by save_depths(). Only output() can be done with them. The target density of the file
+     * replaces the one in the setup file, since the depths were calculated with it. */
+    FILE *fp;
+    char magic[DEPTHS_MAGIC_LEN];
+    int32_t head[2];
+    SavedEvent *buf;
+    EventSink sink;
+    int i, k, n;
+
+    fp = fopen(general->eventfile, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open file %s\n", general->eventfile);
+        exit(1);
+    }
+    if (fread(magic, 1, DEPTHS_MAGIC_LEN, fp) != DEPTHS_MAGIC_LEN || memcmp(magic, DEPTHS_MAGIC, DEPTHS_MAGIC_LEN) ||
+        fread(head, sizeof(int32_t), 2, fp) != 2 || head[0] != DEPTHS_BYTE_ORDER || head[1] < 0 ||
+        fread(&conc->density, sizeof(double), 1, fp) != 1) {
+        fprintf(stderr, "File %s is not a saved depths file (of this byte order)\n", general->eventfile);
+        exit(1);
+    }
+    buf = (SavedEvent *) malloc(sizeof(SavedEvent) * DEPTHS_CHUNK);
+    if (buf == NULL) {
+        fprintf(stderr, "Could not allocate memory for reading depths\n");
+        exit(9);
+    }
+    events_begin(&sink, general, meas, events);
+    for (i = 0; i < head[1]; i += n) {
+        n = min(DEPTHS_CHUNK, head[1] - i);
+        if (fread(buf, sizeof(SavedEvent), n, fp) != (size_t) n) {
+            fprintf(stderr, "File %s ends after %i events, %i expected\n", general->eventfile, i, head[1]);
+            exit(1);
+        }
+        for (k = 0; k < n; k++) {
+            if (buf[k].Z < 1 || buf[k].Z >= general->maxelements) {
+                fprintf(stderr, "Invalid element of event %i in file %s\n", i + k + 1, general->eventfile);
+                exit(2);
             }
-        } else /* element exists */
-            for (ia2 = 1; ia2 < general->maxnucmasses; ia2++) {
-                conc->wprofile[iz2][ia2] = NULL;
-                conc->nprofile[iz2][ia2] = NULL;
+            if (!events_add_depth(&sink, buf[k].Z, buf[k].M, buf[k].d, buf[k].w, i + k)) {
+                fprintf(stderr, "Too many events, reading stopped at event %i\n", i + k + 1);
+                break;
             }
+        }
+        if (k < n)
+            break;
     }
+    events_end(&sink);
+    fclose(fp);
+    free(buf);
+    fprintf(stderr, "Read depths of %i events from %s\n", general->nevents, general->eventfile);
+}
 
-    conc->wprofsum = (double *) malloc(sizeof(double) * nprofile);
-    conc->profmass = (double *) malloc(sizeof(double) * nprofile);
-    conc->nprofsum = (int *) malloc(sizeof(double) * nprofile);
-    for (ip = 0; ip < nprofile; ip++) {
-        conc->wprofsum[ip] = 0.0;
-        conc->profmass[ip] = 0.0;
-        conc->nprofsum[ip] = 0;
+void calculate_depths(General *general, Measurement *meas, Events *events, Stopping *sto, Concentration *conc) {
+    int i;
+    depth_grid_uniform(&conc->grid, general->maxdstep, conc->dstep);
+    if (general->depthgrid == GRID_ADAPTIVE)
+        refine_depth_grid(general, sto, conc, FALSE);
+    reset_events(general, meas, events, conc);
+    create_conc_profile(general, meas, sto, conc);
+    for (i = 0; i < general->niter; i++) {
+        calculate_primary_energy(general, meas, sto, conc);
+        clear_conc(general, conc);
+#ifdef _OPENMP
+        double t_start = omp_get_wtime();
+#endif
+        if (general->ordering == ORDER_COST && general->order)
+            order_events_by_cost(general, events, &conc->grid);
+        calculate_recoil_depths(general, meas, events, sto, conc);
+#ifdef _OPENMP
+        fprintf(stderr, "Iteration %i: recoil depths of %i events calculated in %.3lf s using %i threads\n", i + 1,
+                general->nevents, omp_get_wtime() - t_start, omp_get_max_threads());
+#endif
+        create_conc_profile(general, meas, sto, conc);
+        if (general->depthgrid == GRID_ADAPTIVE && i < general->niter - 1)
+            refine_depth_grid(general, sto, conc, TRUE);
     }
+}
 
-    for (ie = 0; ie < general->nevents; ie++) {
-        z = event[ie].Z;
-        a = event[ie].A;
-#ifdef DEBUG
-        printf("A %8i %10.3e %14.5e\n",z,event[ie].d/(C_TFU),event[ie].w);
-#endif
-        ip = (int) (event[ie].d / general->outstep + NABOVE);
-        ip = max(0, ip);
-        ip = min(nprofile - 1, ip);
+int allocate_general_sto_conc(General *general, Measurement *meas, Stopping *sto, Concentration *conc) {
+    /* Tables are allocated from one arena, in the order they are used. The arena is created large enough for the tables
+     * allocated here, stopping tables reserve more space once the number of velocity steps is known. */
+    int i;
+    size_t size;
+    fprintf(stderr, "Allocating stuff. %i %i\n", general->maxelements, general->maxdstep);
+    size = general->maxelements * (2 * sizeof(int) + sizeof(double) + 5 * sizeof(void *));
+    size += general->maxelements * general->maxelements * sizeof(double *);
+    size += (general->maxelements + 1) * general->maxdstep * (sizeof(double) + sizeof(int));
+    size += (general->maxdstep + 1) * (9 * sizeof(double) + GRID_MAXREFINE * sizeof(int));
+    size += 32 * ARENA_ALIGN;
+    general->arena = arena_create(size);
+    if (!general->arena) {
+        fprintf(stderr, "Could not allocate general tables etc.\n");
+        exit(9);
+    }
+    general->element = (int *) table_alloc(general, general->maxelements, sizeof(int));
+    general->element[meas->Z]++;
+    general->nuclide = NULL;
+    general->nnuclides = 0;
+    general->nucstart = (int *) table_alloc(general, general->maxelements + 1, sizeof(int));
+    general->M = (double *) table_alloc(general, general->maxelements, sizeof(double));
+    sto->ele = (double ***) table_alloc(general, general->maxelements, sizeof(double **));
+    sto->ele[0] = (double **) table_alloc(general, general->maxelements * general->maxelements, sizeof(double *));
+    sto->sum = (double ***) table_alloc(general, general->maxelements, sizeof(double **));
+    sto->sumf = (float ***) table_alloc(general, general->maxelements, sizeof(float **));
+    sto->single = FALSE;
+    conc->w = (double **) table_alloc(general, general->maxelements, sizeof(double *));
+    conc->n = (int **) table_alloc(general, general->maxelements, sizeof(int *));
+    conc->w[0] = (double *) table_alloc(general, (general->maxelements + 1) * general->maxdstep, sizeof(double));
+    conc->n[0] = (int *) table_alloc(general, (general->maxelements + 1) * general->maxdstep, sizeof(int));
+    conc->wsum = conc->w[0] + general->maxelements * general->maxdstep;
+    conc->mass = (double *) table_alloc(general, general->maxdstep, sizeof(double));
+    conc->nsum = conc->n[0] + general->maxelements * general->maxdstep;
+    conc->Ebeam = (double *) table_alloc(general, general->maxdstep + 1, sizeof(double));
+    conc->wprofile = NULL;
+    conc->nprofile = NULL;
+    for (i = 0; i < general->maxelements; i++) {
+        sto->ele[i] = sto->ele[0] + i * general->maxelements;
+        conc->w[i] = conc->w[0] + i * general->maxdstep;
+        conc->n[i] = conc->n[0] + i * general->maxdstep;
+    }
+    conc->grid.n = general->maxdstep;
+    conc->grid.d = (double *) table_alloc(general, general->maxdstep + 1, sizeof(double));
+    conc->grid.h = (double *) table_alloc(general, general->maxdstep + 1, sizeof(double));
+    /* Steps of the adaptive grid are at least 1/GRID_MAXREFINE of the nominal step, depth_grid_make_index() widens the
+     * buckets if they still don't fit. */
+    conc->grid.maxindex = (int) (GRID_MAXREFINE * general->maxdstep) + 2;
+    conc->grid.index = (int *) table_alloc(general, conc->grid.maxindex, sizeof(int));
+    conc->grid.scratch = NULL;
+    if (general->depthgrid == GRID_ADAPTIVE)
+        conc->grid.scratch = (double *) table_alloc(general, 5 * general->maxdstep + 2, sizeof(double));
+    depth_grid_uniform(&conc->grid, general->maxdstep, conc->dstep);
+    sto->grid = &conc->grid;
+    return 0;
+}
+
+void *table_alloc(General *general, size_t n, size_t size) {
+    /* Zeroed memory from the arena of the run, freed all at once by arena_free() */
+    void *p = arena_calloc(general->arena, n, size);
+    if (!p) {
+        fprintf(stderr, "Could not allocate tables (%zu bytes).\n", n * size);
+        exit(9);
+    }
+    return p;
+}
+
+void output(General *general, Concentration *conc, Events *events, double *amount) {
+    /* Profiles of all output steps are binned in one pass over the events. With more than one output step the step
+     * (in tfu) is added to the prefix of output files. If amount is not NULL, areal densities of nuclides (at the first
+     * output step) are stored there. Histograms are freed on return (not taken from the arena), so that repeated
+     * output, e.g. in a sweep, doesn't grow the arena. */
+    char prefix[NAMELEN];
+    int k, ie, ie0, nsteps = general->noutsteps, *nprofile, *cell;
+    Histogram *hist;
+
+    hist = (Histogram *) malloc(sizeof(Histogram) * nsteps);
+    nprofile = (int *) malloc(sizeof(int) * nsteps);
+    cell = (int *) malloc(sizeof(int) * HISTOGRAM_CHUNK * nsteps);
+    if (!hist || !nprofile || !cell) {
+        fprintf(stderr, "Could not allocate output histograms\n");
+        exit(9);
+    }
+    for (k = 0; k < nsteps; k++) {
+        nprofile[k] = (general->maxdstep * conc->dstep) / general->outsteps[k] + NABOVE;
+        hist[k].nrows = general->nnuclides + 1;
+        hist[k].nbins = nprofile[k];
+        hist[k].w = (double *) calloc(hist[k].nrows * hist[k].nbins, sizeof(double));
+        hist[k].n = (int *) calloc(hist[k].nrows * hist[k].nbins, sizeof(int));
+        hist[k].m = (double *) calloc(hist[k].nbins, sizeof(double));
+        if (!hist[k].w || !hist[k].n || !hist[k].m) {
+            fprintf(stderr, "Could not allocate output histograms\n");
+            exit(9);
+        }
+    }
+
+    for (ie0 = 0; ie0 < general->nevents; ie0 += HISTOGRAM_CHUNK) {
+        int n = min(HISTOGRAM_CHUNK, general->nevents - ie0);
+#pragma omp parallel for default(none) shared(general, events, cell, nprofile, nsteps, ie0, n)
+        for (ie = 0; ie < n; ie++) {
+            double d = event_d(events, ie0 + ie);
+            int nuc = event_nuc(events, ie0 + ie);
+            for (int kk = 0; kk < nsteps; kk++) {
+                int ipe = (int) (d / general->outsteps[kk] + NABOVE);
+                ipe = max(0, ipe);
+                ipe = min(nprofile[kk] - 1, ipe);
+                cell[kk * n + ie] = nuc * nprofile[kk] + ipe;
+            }
+        }
 #ifdef DEBUG
-        printf("%8i %10.2f %14.5f %8i\n",ip,event[ie].d/(C_TFU),
-                event[ie].w,event[ie].n);
+        for (ie = 0; ie < n; ie++) {
+            printf("A %8i %10.3e %14.5e\n",event_Z(events, ie0 + ie),event_d(events, ie0 + ie)/(C_TFU),event_w(events, ie0 + ie));
+            printf("%8i %10.2f %14.5f\n",cell[ie] % nprofile[0],event_d(events, ie0 + ie)/(C_TFU),
+                    event_w(events, ie0 + ie));
+        }
 #endif
-        conc->wprofile[z][a][ip] += event[ie].w;
-        conc->nprofile[z][a][ip]++;
-        conc->wprofsum[ip] += event[ie].w;
-        conc->profmass[ip] += event[ie].M * event[ie].w;
-        conc->nprofsum[ip]++;
+        histogram_fill_multi(hist, nsteps, events, ie0, n, cell);
+    }
+    free(cell);
+
+    for (k = 0; k < nsteps; k++) {
+        int len;
+        if (nsteps > 1)
+            len = snprintf(prefix, NAMELEN, "%s_%g", general->prefix, general->outsteps[k] / C_TFU);
+        else
+            len = snprintf(prefix, NAMELEN, "%s", general->prefix);
+        if (len >= NAMELEN - 20) { /* Room for suffixes */
+            fprintf(stderr, "Output prefix %s is too long\n", general->prefix);
+            exit(6);
+        }
+        output_profiles(general, conc, &hist[k], general->outsteps[k], prefix, k == 0 ? amount : NULL);
+    }
+    for (k = 0; k < nsteps; k++) {
+        free(hist[k].w);
+        free(hist[k].n);
+        free(hist[k].m);
     }
+    conc->wprofile = NULL;
+    conc->nprofile = NULL;
+    conc->wprofsum = NULL;
+    conc->nprofsum = NULL;
+    conc->profmass = NULL;
+    free(hist);
+    free(nprofile);
+}
+
+void output_profiles(General *general, Concentration *conc, Histogram *hist, double outstep, const char *prefix,
+                     double *amount) {
+    /* Scales and writes the profiles of one output step. The profile tables of conc are set to those of hist. Areal
+     * densities (1e15 at./cm2) of nuclides below the surface are stored in amount, unless it is NULL. */
+    char fname[NAMELEN];
+    double max_change, nominal, wsum = 0.0, dep, dep0, mdep, mdep0, d, relerr;
+    int inuc, ip, minp, maxp, nprofile = hist->nbins;
+    Profiles *prof;
+
+    conc->wprofile = hist->w;
+    conc->nprofile = hist->n;
+    conc->wprofsum = hist->w + general->nnuclides * nprofile;
+    conc->nprofsum = hist->n + general->nnuclides * nprofile;
+    conc->profmass = hist->m;
 
     for (ip = 0; ip < nprofile; ip++) {
         if (conc->wprofsum[ip] > 0.0)
-            conc->profmass[ip] *= (general->outstep / conc->wprofsum[ip]);
+            conc->profmass[ip] *= (outstep / conc->wprofsum[ip]);
         else
             conc->profmass[ip] = 0.0;
     }
 
     if (general->scale) {
-        minp = (int) (general->minscale / general->outstep + NABOVE);
+        minp = (int) (general->minscale / outstep + NABOVE);
         minp = max(0, min(minp, nprofile - 1));
-        maxp = (int) (general->maxscale / general->outstep + NABOVE);
+        maxp = (int) (general->maxscale / outstep + NABOVE);
         maxp = max(0, min(maxp, nprofile - 1));
         for (ip = minp; ip < maxp; ip++)
             wsum += conc->wprofsum[ip];
@@ -348,82 +637,69 @@ void output(General *general, Concentration *conc, Event *event) {
         wsum /= (ip - 2 - NABOVE);
     }
 
-    for (iz2 = 1; iz2 < general->maxelements; iz2++) {
-        if (general->element[iz2] > 0) {
-            for (ia2 = 1; ia2 < general->maxnucmasses; ia2++) {
-                if (general->nuclide[iz2][ia2] > 0) {
-                    dep = mdep = dep0 = mdep0 = 0.0;
-                    strcpy(fname, general->prefix);
-                    strcat(fname, ".");
-                    if (general->nuclide[iz2][0] > 1) { /* more than one isotope */
-                        sprintf(fnuc, "%i", ia2);
-                        strcat(fname, fnuc);
-                    }
-                    strcat(fname, general->jibal->elements[iz2].name);
-                    fp = fopen(fname, "w");
-                    fprintf(stderr, "Writing output to file %s\n", fname);
-                    if (fp == NULL) {
-                        fprintf(stderr, "Could not open file %s\n for writing", fname);
-                        exit(6);
-                    }
-                    for (ip = 0; ip < NABOVE; ip++) {
-                        mdep0 += conc->profmass[ip];
-                        dep0 += conc->profmass[ip] / conc->density;
-                    }
-                    for (ip = 0; ip < nprofile; ip++) {
-                        d = (ip - NABOVE) * general->outstep;
-                        d += 0.5 * general->outstep;
-                        if (conc->nprofile[iz2][ia2][ip] > 0)
-                            relerr = 1.0 / sqrt((double) (conc->nprofile[iz2][ia2][ip]));
-                        else
-                            relerr = 1;
-                        fprintf(fp, "%10.3f %10.3f %10.3f ", d / (C_TFU),
-                                (mdep - mdep0) / (C_UG / C_CM2),
-                                (dep - dep0) / C_NM);
-/*
-                  fprintf(fp,"%10.3f ",(dep-dep0)/C_NM);
-*/
-                        fprintf(fp, "  %10.5f", conc->wprofile[iz2][ia2][ip] / wsum);
-                        fprintf(fp, "  %14.5e", conc->wprofile[iz2][ia2][ip]);
-                        fprintf(fp, "  %10.5f", relerr * conc->wprofile[iz2][ia2][ip] / wsum);
-                        fprintf(fp, "  %10i", conc->nprofile[iz2][ia2][ip]);
-                        fprintf(fp, "\n");
-                        mdep += conc->profmass[ip];
-                        dep += conc->profmass[ip] / conc->density;
-                    }
-                    fclose(fp);
-                } /* nuclide exists */
-            } /* loop through nuclides */
-        } /* element exists */
-    } /* loop though elements */
-
-    strcpy(fname, general->prefix);
-    strcat(fname, ".");
-    strcat(fname, "total");
-    fp = fopen(fname, "w");
-    if (fp == NULL) {
-        fprintf(stderr, "Could not open file %s\n for writing", fname);
+    prof = profiles_alloc(general->nnuclides, nprofile);
+    if (prof == NULL) {
+        fprintf(stderr, "Could not allocate output profiles\n");
         exit(6);
     }
+    prof->outstep = outstep / C_TFU;
+    prof->density = conc->density / C_G_CM3;
+    prof->wsum = wsum;
+
     dep = mdep = dep0 = mdep0 = 0.0;
     for (ip = 0; ip < NABOVE; ip++) {
         mdep0 += conc->profmass[ip];
         dep0 += conc->profmass[ip] / conc->density;
     }
     for (ip = 0; ip < nprofile; ip++) {
-        d = (ip - NABOVE) * general->outstep;
-        id = max(0, (int) (d / conc->dstep));
-        d += 0.5 * general->outstep;
-        fprintf(fp, "%7.2f %10.3f %10.3f ", d / (C_TFU),
-                (mdep - mdep0) / (C_UG / C_CM2),
-                (dep - dep0) / C_NM);
-        fprintf(fp, "%10.4e\n", conc->wprofsum[ip] / wsum);
+        d = (ip - NABOVE) * outstep;
+        d += 0.5 * outstep;
+        prof->depth[ip] = d / (C_TFU);
+        prof->mdepth[ip] = (mdep - mdep0) / (C_UG / C_CM2);
+        prof->ldepth[ip] = (dep - dep0) / C_NM;
+        prof->conc[general->nnuclides * nprofile + ip] = conc->wprofsum[ip] / wsum;
         mdep += conc->profmass[ip];
         dep += conc->profmass[ip] / conc->density;
-
     }
-    fclose(fp);
 
+    for (inuc = 0; inuc < general->nnuclides; inuc++) {
+        const Nuclide *nuc = &general->nuclide[inuc];
+        const double *wprofile = conc->wprofile + inuc * nprofile;
+        const int *nprof = conc->nprofile + inuc * nprofile;
+        ProfileNuclide *pnuc = &prof->nuclide[inuc];
+        pnuc->Z = nuc->Z;
+        pnuc->A = nuc->A;
+        pnuc->M = nuc->M / C_U;
+        if (general->nucstart[nuc->Z + 1] - general->nucstart[nuc->Z] > 1) /* more than one isotope */
+            snprintf(pnuc->name, PROFILES_NAMELEN, "%i%s", nuc->A, general->jibal->elements[nuc->Z].name);
+        else
+            snprintf(pnuc->name, PROFILES_NAMELEN, "%s", general->jibal->elements[nuc->Z].name);
+        for (ip = 0; ip < nprofile; ip++) {
+            if (nprof[ip] > 0)
+                relerr = 1.0 / sqrt((double) (nprof[ip]));
+            else
+                relerr = 1;
+            prof->conc[inuc * nprofile + ip] = wprofile[ip] / wsum;
+            prof->w[inuc * nprofile + ip] = wprofile[ip];
+            prof->err[inuc * nprofile + ip] = relerr * wprofile[ip] / wsum;
+            prof->n[inuc * nprofile + ip] = nprof[ip];
+        }
+        if (amount) {
+            amount[inuc] = 0.0;
+            for (ip = NABOVE; ip < nprofile; ip++)
+                amount[inuc] += prof->conc[inuc * nprofile + ip] * prof->outstep;
+        }
+    } /* loop through nuclides */
+
+    if (general->outformat != OUTPUT_BINARY && profiles_write_text(prof, prefix))
+        exit(6);
+    if (general->outformat != OUTPUT_TEXT) {
+        strcpy(fname, prefix);
+        strcat(fname, PROFILES_EXTENSION);
+        if (profiles_write_binary(prof, fname))
+            exit(6);
+    }
+    profiles_free(prof);
 }
 
 char *get_symbol(int z) {
@@ -457,103 +733,259 @@ char *get_symbol(int z) {
 
 }
 
-void calculate_recoil_depths(General *general, Measurement *meas, Event *event,
+void calculate_recoil_depths(General *general, Measurement *meas, Events *events,
                              Stopping *sto, Concentration *conc) {
-    int ie;
-#pragma omp parallel default(none) shared(general, meas, event, sto, conc)
-#pragma omp for schedule(static, PARALLEL_EVENTS)
-    for (ie = 0; ie < general->nevents; ie++) {
-        double K, dmult, recE, beamE, d, dstep, M, dE = 0, w, bk, rk;
-        int Z, id;
-        Z = event[ie].Z;
-        M = event[ie].M;
-        dmult = 1.0 / sin(event[ie].theta - meas->target_angle);
-
-        if (event[ie].type == ERD) {
-            K = (4.0 * meas->M * event[ie].M * ipow2(cos(event[ie].theta))) /
-                ipow2(meas->M + event[ie].M);
-        } else {   /* RBS */
-            K = sqrt(ipow2(event[ie].M) - ipow2(meas->M * sin(event[ie].theta)));
-            K += meas->M * cos(event[ie].theta);
-            K /= (meas->M + event[ie].M);
-            K = ipow2(K);
-        }
-
-        d = 0.0;
-        id = 0;
-        dstep = conc->dstep;
-
-        recE = event[ie].E;
-        beamE = conc->Ebeam[0] * K;
-
-        if (recE >= beamE) {
-            dE = get_eloss(general, Z, M, recE, d, dstep * dmult, sto);
-            rk = dE / dstep;
-            bk = (conc->Ebeam[id + 1] * K - conc->Ebeam[id] * K) / dstep;
-            event[ie].d = 0.5 * (d - dstep) + (conc->Ebeam[id] * K - (recE - dE)) / (rk - bk);
-            beamE = conc->Ebeam[0];
-#ifdef DEBUG
-            printf("A %8i %10.3f\n",Z,event[ie].d/(C_TFU));
-#endif
-        } else {
-            while ((id < general->maxdstep) && (recE < beamE)) {
-                if (event[ie].type == ERD)
-                    dE = get_eloss(general, Z, M, recE, d, dstep * dmult, sto);
-                else
-                    dE = get_eloss(general, meas->Z, meas->M, recE, d, dstep * dmult, sto);
-                recE += dE;
-                id++;
-                d += dstep;
-                beamE = conc->Ebeam[id] * K;
+    int i, i0, *cell;
+    Histogram hist;
+#pragma omp parallel default(none) shared(general, meas, events, sto, conc)
+#pragma omp for schedule(dynamic, PARALLEL_EVENTS)
+    for (i = 0; i < general->nevents; i++) {
+        int ie = general->order ? general->order[i] : i, cost;
+        double d = event_d(events, ie), w;
+        cost = recoil_depth(general, meas, sto, conc, event_type(events, ie), event_Z(events, ie), event_M(events, ie),
+                            event_theta(events, ie) + meas->detector_offset, event_E(events, ie), event_w0(events, ie),
+                            &d, &w);
+        event_set(events, ie, d, w, cost);
+    }
+    hist.nrows = general->maxelements + 1;
+    hist.nbins = general->maxdstep;
+    hist.w = conc->w[0];
+    hist.n = conc->n[0];
+    hist.m = NULL;
+    cell = (int *) malloc(sizeof(int) * HISTOGRAM_CHUNK);
+    for (i0 = 0; i0 < general->nevents; i0 += HISTOGRAM_CHUNK) {
+        int n = min(HISTOGRAM_CHUNK, general->nevents - i0);
+#pragma omp parallel for default(none) shared(general, events, conc, cell, i0, n)
+        for (i = 0; i < n; i++) {
+            double d = event_d(events, i0 + i);
+            int id;
+            if (d < 0.0) {
+                id = 0;
+            } else if (conc->grid.uniform) {
+                id = (int) (d / conc->dstep);
+            } else {
+                id = depth_grid_step(&conc->grid, d);
             }
-            if (id < general->maxdstep) {
-                bk = (beamE - conc->Ebeam[id - 1] * K) / dstep;
-                rk = dE / dstep;
-                event[ie].d = (d - dstep) + (conc->Ebeam[id - 1] * K - (recE - dE)) / (rk - bk);
-                recE = (recE - dE) + rk * (event[ie].d - (d - dstep));
+            if (id >= general->maxdstep || !(event_w(events, i0 + i) > 0.0)) {
+                cell[i] = -1;
+                continue;
             }
-            beamE = conc->Ebeam[id] + (event[ie].d - id * dstep) *
-                                      (conc->Ebeam[id] - conc->Ebeam[id - 1]) / dstep;
+            cell[i] = event_Z(events, i0 + i) * general->maxdstep + id;
+        }
+        histogram_fill(&hist, events, i0, n, cell);
+    }
+    free(cell);
+}
+
+int recoil_depth(General *general, Measurement *meas, Stopping *sto, Concentration *conc, int type, int Z, double M,
+                 double theta, double E, double w0, double *depth, double *weight) {
+    /* Depth and weight of one event (of recoil or scattered ion Z, M detected at angle theta with energy E). Returns
+     * the number of depth steps taken. The depth is left unchanged if the event is not within the depth grid. */
+    double K, dmult, recE, beamE, d, dstep, dE = 0, w, bk, rk;
+    const DepthGrid *grid = &conc->grid;
+    int id;
+    dmult = 1.0 / sin(theta - meas->target_angle);
+
+    if (type == ERD) {
+        K = (4.0 * meas->M * M * ipow2(cos(theta))) /
+            ipow2(meas->M + M);
+    } else {   /* RBS */
+        K = sqrt(ipow2(M) - ipow2(meas->M * sin(theta)));
+        K += meas->M * cos(theta);
+        K /= (meas->M + M);
+        K = ipow2(K);
+    }
+
+    d = 0.0;
+    id = 0;
+    dstep = grid->h[0];
+
+    recE = E;
+    beamE = conc->Ebeam[0] * K;
+
+    if (recE >= beamE) {
+        dE = get_eloss(general, Z, M, recE, d, dstep * dmult, sto);
+        rk = dE / dstep;
+        bk = (conc->Ebeam[id + 1] * K - conc->Ebeam[id] * K) / dstep;
+        *depth = 0.5 * (d - dstep) + (conc->Ebeam[id] * K - (recE - dE)) / (rk - bk);
+        beamE = conc->Ebeam[0];
 #ifdef DEBUG
-            printf("B %8i %10.3f\n",Z,event[ie].d/(C_TFU));
+        printf("A %8i %10.3f\n",Z,*depth/(C_TFU));
 #endif
+    } else {
+        while ((id < general->maxdstep) && (recE < beamE)) {
+            dstep = grid->h[id];
+            if (type == ERD)
+                dE = get_eloss(general, Z, M, recE, d, dstep * dmult, sto);
+            else
+                dE = get_eloss(general, meas->Z, meas->M, recE, d, dstep * dmult, sto);
+            recE += dE;
+            id++;
+            d += dstep;
+            beamE = conc->Ebeam[id] * K;
         }
-
         if (id < general->maxdstep) {
-            if (event[ie].type == ERD) {
-                w = Serd(meas->Z, meas->M, event[ie].Z, event[ie].M, event[ie].theta, beamE, general->cs);
-            } else {
-                w = Srbs(meas->Z, meas->M, event[ie].Z, event[ie].M, event[ie].theta, beamE, general->cs);
-            }
-            event[ie].w = event[ie].w0 / w;
+            bk = (beamE - conc->Ebeam[id - 1] * K) / dstep;
+            rk = dE / dstep;
+            *depth = (d - dstep) + (conc->Ebeam[id - 1] * K - (recE - dE)) / (rk - bk);
+            recE = (recE - dE) + rk * (*depth - (d - dstep));
+        }
+        beamE = conc->Ebeam[id] + (*depth - grid->d[id]) *
+                                  (conc->Ebeam[id] - conc->Ebeam[id - 1]) / dstep;
 #ifdef DEBUG
-            printf("W %i %10.4f %10.4f\n",event[ie].type,w/C_BARN,beamE/C_MEV);
-            printf("%3i %14.5e %14.5e\n",Z,(event[ie].d*C_CM2)/1.0e15,event[ie].w);
+        printf("B %8i %10.3f\n",Z,*depth/(C_TFU));
 #endif
-        } else {
-            event[ie].w = 0.0;
-        }
     }
-    int n = 0;
-    for (int ie = 0; ie < general->nevents; ie++) {
-        int id;
-        int Z = event[ie].Z;
-        if(event[ie].d < 0.0) {
-            id = 0;
+
+    if (id < general->maxdstep) {
+        if (type == ERD) {
+            w = Serd(meas->Z, meas->M, Z, M, theta, beamE, general->cs);
         } else {
-            id = (int) (event[ie].d / conc->dstep);
+            w = Srbs(meas->Z, meas->M, Z, M, theta, beamE, general->cs);
         }
-        if(id >= general->maxdstep) {
-            continue;
+        *weight = w0 / w;
+#ifdef DEBUG
+        printf("W %i %10.4f %10.4f\n",type,w/C_BARN,beamE/C_MEV);
+        printf("%3i %14.5e %14.5e\n",Z,(*depth*C_CM2)/1.0e15,*weight);
+#endif
+    } else {
+        *weight = 0.0;
+    }
+    return id;
+}
+
+void histogram_fill(Histogram *hist, const Events *events, int first, int nevents, const int *cell) {
+    histogram_fill_multi(hist, 1, events, first, nevents, cell);
+}
+
+void histogram_fill_multi(Histogram *hist, int nhist, const Events *events, int first, int nevents, const int *cell) {
+    /* Adds weights of events first..first+nevents-1 to hist[h].w at cell (row*nbins + bin) and to the sum row, for
+     * h = 0..nhist-1. The cells of histogram h are cell[h*nevents..(h+1)*nevents-1]. Events with cell < 0 are skipped.
+     * cell[0] is the cell of event first. Each event is read once for all histograms.
+     *
+     * The events are summed in fixed blocks of REDUCTION_BLOCK events, and the partial sums are added to the
+     * histogram in block order. The result is therefore bit for bit the same regardless of the number of threads, and
+     * when first is a multiple of HISTOGRAM_CHUNK the same as if all events were added at once. */
+    int nblocks = (nevents + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK;
+    int size = 0, nbins = 0, *woff, *moff; /* Partial sums of all histograms are stored one after another */
+    int b0, b, h, k;
+    double *pw, *pm;
+    int *pn;
+    woff = (int *) malloc(sizeof(int) * nhist);
+    moff = (int *) malloc(sizeof(int) * nhist);
+    if (!woff || !moff) {
+        fprintf(stderr, "Could not allocate partial sums for histogram.\n");
+        exit(9);
+    }
+    for (h = 0; h < nhist; h++) {
+        woff[h] = size;
+        moff[h] = nbins;
+        size += hist[h].nrows * hist[h].nbins;
+        nbins += hist[h].nbins;
+    }
+    pw = (double *) malloc(sizeof(double) * REDUCTION_WAVE * size);
+    pn = (int *) malloc(sizeof(int) * REDUCTION_WAVE * size);
+    pm = (double *) malloc(sizeof(double) * REDUCTION_WAVE * nbins);
+    if (!pw || !pn || !pm) {
+        fprintf(stderr, "Could not allocate partial sums for histogram.\n");
+        exit(9);
+    }
+    for (b0 = 0; b0 < nblocks; b0 += REDUCTION_WAVE) {
+        int nb = min(REDUCTION_WAVE, nblocks - b0);
+#pragma omp parallel for default(none) shared(hist, nhist, events, first, cell, nevents, size, nbins, woff, moff, b0, nb, pw, pn, pm) schedule(dynamic, 1)
+        for (b = 0; b < nb; b++) {
+            double *w = pw + b * size, *m = pm + b * nbins;
+            int *n = pn + b * size;
+            int ie, ie_end = min(nevents, (b0 + b + 1) * REDUCTION_BLOCK);
+            memset(w, 0, sizeof(double) * size);
+            memset(n, 0, sizeof(int) * size);
+            memset(m, 0, sizeof(double) * nbins);
+            for (ie = (b0 + b) * REDUCTION_BLOCK; ie < ie_end; ie++) {
+                double ew = event_w(events, first + ie);
+                double em = event_M(events, first + ie) * ew;
+                for (int hh = 0; hh < nhist; hh++) {
+                    int c = cell[hh * nevents + ie], bin, sumrow;
+                    if (c < 0)
+                        continue;
+                    bin = c % hist[hh].nbins;
+                    sumrow = (hist[hh].nrows - 1) * hist[hh].nbins;
+                    w[woff[hh] + c] += ew;
+                    n[woff[hh] + c]++;
+                    w[woff[hh] + sumrow + bin] += ew;
+                    n[woff[hh] + sumrow + bin]++;
+                    m[moff[hh] + bin] += em;
+                }
+            }
         }
-        if(event[ie].w > 0.0) {
-            conc->w[Z][id] += event[ie].w;
-            conc->n[Z][id]++;
-            conc->wsum[id] += event[ie].w;
-            conc->nsum[id]++;
-            n++;
+        for (h = 0; h < nhist; h++) {
+            Histogram *hi = &hist[h];
+            int hsize = hi->nrows * hi->nbins;
+#pragma omp parallel for default(none) shared(hi, hsize, size, nbins, woff, moff, h, nb, pw, pn, pm)
+            for (k = 0; k < hsize; k++) {
+                for (int bb = 0; bb < nb; bb++) {
+                    hi->w[k] += pw[bb * size + woff[h] + k];
+                    hi->n[k] += pn[bb * size + woff[h] + k];
+                    if (hi->m && k < hi->nbins)
+                        hi->m[k] += pm[bb * nbins + moff[h] + k];
+                }
+            }
         }
     }
+    free(pw);
+    free(pn);
+    free(pm);
+    free(woff);
+    free(moff);
+}
+
+void order_events_by_cost(General *general, Events *events, const DepthGrid *grid) {
+    /* Counting sort of events by the number of depth steps they took on the previous iteration. Expensive events are
+     * handed out first, so the cheap ones fill the gaps at the end of the dynamically scheduled loop. The sort is
+     * stable, so on the first iteration (all costs zero) the events are processed in file order. */
+    int *count, ie, c, n = 0;
+    count = (int *) calloc(general->maxdstep + 2, sizeof(int));
+    for (ie = 0; ie < general->nevents; ie++) {
+        count[general->maxdstep - min(max(event_cost(events, grid, ie), 0), general->maxdstep)]++;
+    }
+    for (c = 0; c <= general->maxdstep; c++) {
+        int tmp = count[c];
+        count[c] = n;
+        n += tmp;
+    }
+    for (ie = 0; ie < general->nevents; ie++) {
+        general->order[count[general->maxdstep - min(max(event_cost(events, grid, ie), 0), general->maxdstep)]++] = ie;
+    }
+    free(count);
+}
+
+void order_events_by_locality(General *general, Events *events) {
+    /* Counting sort of events by (type, Z, energy bin), so that consecutive events take the same branches and use
+     * the same rows of the stopping tables. The order of events is kept in general->order, the events themselves stay
+     * in file order. */
+    int *count, *key, ie, k, nkeys, n = 0;
+    double Emax = 0.0;
+    nkeys = (RBS + 1) * general->maxelements * ORDER_EBINS;
+    count = (int *) calloc(nkeys, sizeof(int));
+    key = (int *) malloc(sizeof(int) * max(general->nevents, 1));
+    for (ie = 0; ie < general->nevents; ie++) {
+        Emax = max(Emax, event_E(events, ie));
+    }
+    for (ie = 0; ie < general->nevents; ie++) {
+        int ebin = Emax > 0.0 ? (int) (ORDER_EBINS * event_E(events, ie) / Emax) : 0;
+        ebin = min(max(ebin, 0), ORDER_EBINS - 1);
+        key[ie] = (event_type(events, ie) * general->maxelements + event_Z(events, ie)) * ORDER_EBINS + ebin;
+        count[key[ie]]++;
+    }
+    for (k = 0; k < nkeys; k++) {
+        int tmp = count[k];
+        count[k] = n;
+        n += tmp;
+    }
+    for (ie = 0; ie < general->nevents; ie++) {
+        general->order[count[key[ie]]++] = ie;
+    }
+    free(key);
+    free(count);
 }
 
 double Lecuyer(int z1, int z2, double E) { /* E in CM coordinates */
@@ -638,9 +1070,8 @@ void calculate_primary_energy(General *general, Measurement *meas, Stopping *sto
     Emin = 0.1 * meas->E;
     dmult = 1.0 / sin(meas->target_angle);
 
-    dstep = conc->dstep;
-
-    while (id < general->maxdstep) {
+    while (id <= general->maxdstep) {
+        dstep = conc->grid.h[id];
 #ifdef DEBUG
         printf("P %14.5e %14.5e\n",(d*C_CM2)/1.0e15,E/C_MEV);
 #endif
@@ -655,6 +1086,61 @@ void calculate_primary_energy(General *general, Measurement *meas, Stopping *sto
 }
 
 double get_eloss(General *general, int z, double m, double E, double d, double deltad, Stopping *sto) {
+    switch (general->integrator) {
+        case INTEGRATOR_TRAPEZOID:
+        default:
+            return get_eloss_trapezoid(general, z, m, E, d, deltad, sto);
+        case INTEGRATOR_RK23:
+            return get_eloss_rk23(general, z, m, E, d, deltad, sto);
+    }
+}
+
+double get_eloss_rk23(General *general, int z, double m, double E, double d, double deltad, Stopping *sto) {
+    /* Bogacki-Shampine 3(2) pair for dE/dx = -S(E, x), x from d to d + deltad. The stopping at the end of an
+     * accepted step is the first stage of the next one (FSAL), so an accepted step costs three stopping
+     * evaluations. The step is shrunk or grown to keep the energy error of each step below general->eloss_tolerance. */
+    double x, xend, h, y, y2, y3, y1, k1, k2, k3, k4, err, f;
+
+    if (E <= 0.0)
+        return (0.0);
+
+    x = d;
+    xend = d + deltad;
+    h = deltad;
+    y = E;
+    k1 = inter_sto(general, z, sqrt((2.0 * y) / m), x, sto);
+
+    while (xend - x > 1.0e-6 * deltad) {
+        h = min(h, xend - x);
+        y2 = y - 0.5 * h * k1;
+        if (y2 <= 0.0)
+            return (0.0);
+        k2 = inter_sto(general, z, sqrt((2.0 * y2) / m), x + 0.5 * h, sto);
+        y3 = y - 0.75 * h * k2;
+        if (y3 <= 0.0)
+            return (0.0);
+        k3 = inter_sto(general, z, sqrt((2.0 * y3) / m), x + 0.75 * h, sto);
+        y1 = y - h * (2.0 / 9.0 * k1 + 1.0 / 3.0 * k2 + 4.0 / 9.0 * k3);
+        if (y1 <= 0.0)
+            return (0.0);
+        k4 = inter_sto(general, z, sqrt((2.0 * y1) / m), x + h, sto);
+        err = h * fabs(-5.0 / 72.0 * k1 + 1.0 / 12.0 * k2 + 1.0 / 9.0 * k3 - 1.0 / 8.0 * k4);
+        if (err <= general->eloss_tolerance) {
+            x += h;
+            y = y1;
+            k1 = k4;
+        }
+        if (err > 0.0)
+            f = 0.9 * cbrt(general->eloss_tolerance / err);
+        else
+            f = 4.0;
+        h *= min(4.0, max(0.2, f));
+    }
+
+    return (E - y);
+}
+
+double get_eloss_trapezoid(General *general, int z, double m, double E, double d, double deltad, Stopping *sto) {
     double dstep, dE, s1 = 0, s2 = 0, v, v2, r, dmin, dmax;
 
     dE = 0.0;
@@ -694,32 +1180,49 @@ double get_eloss(General *general, int z, double m, double E, double d, double d
 
 double inter_sto(General *general, int z1, double v, double d, Stopping *sto) {
     double **S;
-    double value, s1, s2, vdiv, ddiv;
+    double value, s1, s2, vdiv, ddiv, x;
     int iv, id;
 
-    S = sto->sum[z1];
-
     vdiv = sto->vdiv;
     ddiv = sto->ddiv;
 
     iv = (int) (v * vdiv);
     iv = min(max(0.0, iv), sto->vsteps - 2);
 
-    id = (int) (d * ddiv);
-    id = min(max(0.0, id), general->maxdstep - 2);
+    if (sto->grid->uniform) {
+        id = (int) (d * ddiv);
+        id = min(max(0.0, id), general->maxdstep - 2);
+        x = d * ddiv - id;
+    } else {
+        id = min(depth_grid_step(sto->grid, d), general->maxdstep - 2);
+        x = (d - sto->grid->d[id]) / sto->grid->h[id];
+    }
+
+    if (sto->single) {
+        float **F = sto->sumf[z1];
+        float fv = (float) (v * vdiv - iv), fx = (float) x, f1, f2;
+        f1 = F[iv][id] + fv * (F[iv + 1][id] - F[iv][id]);
+        f2 = F[iv][id + 1] + fv * (F[iv + 1][id + 1] - F[iv][id + 1]);
+        return ((f1 + fx * (f2 - f1)) * STO_FLOAT_UNIT);
+    }
+
+    S = sto->sum[z1];
 
     s1 = S[iv][id] + (v * vdiv - iv) * (S[iv + 1][id] - S[iv][id]);
     s2 = S[iv][id + 1] + (v * vdiv - iv) * (S[iv + 1][id + 1] - S[iv][id + 1]);
 
-    value = s1 + (d * ddiv - id) * (s2 - s1);
+    value = s1 + x * (s2 - s1);
 
     return (value);
 
 }
 
 void create_conc_profile(General *general, Measurement *meas, Stopping *sto, Concentration *conc) {
-    double d = 0.0, **p;
-    int iz1, iz2, id, iv, minn, n, nsum;
+    double d = 0.0;
+    int iz2, id, minn, n, nsum;
+#ifdef DEBUG
+    int iv;
+#endif
 
     sto->dstep = conc->dstep;
     sto->ddiv = 1.0 / conc->dstep;
@@ -758,31 +1261,7 @@ void create_conc_profile(General *general, Measurement *meas, Stopping *sto, Con
         }
     }
 
-    for (iz1 = 1; iz1 < general->maxelements; iz1++) {
-        if (general->element[iz1] > 0) {
-            if (sto->sum[iz1] == NULL) {
-                p = (double **) malloc(sizeof(double *) * sto->vsteps);
-                for (iv = 0; iv < sto->vsteps; iv++)
-                    p[iv] = malloc(sizeof(double) * general->maxdstep);
-                sto->sum[iz1] = p;
-            }
-            for (id = 0; id < general->maxdstep; id++)
-                for (iv = 0; iv < sto->vsteps; iv++)
-                    sto->sum[iz1][iv][id] = 0.0;
-        }
-    }
-
-    for (iz1 = 1; iz1 < general->maxelements; iz1++) {
-        if (general->element[iz1] > 0) {
-            for (iz2 = 1; iz2 < general->maxelements; iz2++)
-                if (general->element[iz2] > 0) {
-                    for (id = 0; id < general->maxdstep; id++)
-                        for (iv = 0; iv < sto->vsteps; iv++)
-                            sto->sum[iz1][iv][id] += conc->w[iz2][id] * sto->ele[iz1][iz2][iv];
-                }
-
-        }
-    }
+    create_sumsto(general, sto, conc);
 
 #ifdef DEBUG
     for(iv=0;iv<sto->vsteps;iv++){
@@ -793,7 +1272,7 @@ void create_conc_profile(General *general, Measurement *meas, Stopping *sto, Con
     printf("\n");
 
     for (id = 0; id < general->maxdstep / 10; id++) {
-        printf("%6.1f ", (id * conc->dstep) / (C_TFU));
+        printf("%6.1f ", conc->grid.d[id] / (C_TFU));
         for (iz2 = 1; iz2 < general->maxelements; iz2++) {
             if (general->element[iz2] > 0) {
                 printf("%2i %4.1f ", iz2, conc->w[iz2][id] * 100.0);
@@ -804,6 +1283,180 @@ void create_conc_profile(General *general, Measurement *meas, Stopping *sto, Con
 
 }
 
+void create_sumsto(General *general, Stopping *sto, Concentration *conc) {
+    /* Stopping in the sample, sum[z1][iv][id], weighted by concentrations of each depth step. Sums are always
+     * calculated in double precision, the single precision table only stores the result. */
+    double **p;
+    float **pf;
+    int iz1, iz2, id, iv;
+
+    for (iz1 = 1; iz1 < general->maxelements; iz1++) {
+        if (general->element[iz1] == 0)
+            continue;
+        if (sto->single && sto->sumf[iz1] == NULL) {
+            pf = (float **) table_alloc(general, sto->vsteps, sizeof(float *));
+            pf[0] = (float *) table_alloc(general, sto->vsteps * general->maxdstep, sizeof(float));
+            for (iv = 1; iv < sto->vsteps; iv++)
+                pf[iv] = pf[0] + iv * general->maxdstep;
+            sto->sumf[iz1] = pf;
+        }
+        if (!sto->single && sto->sum[iz1] == NULL) {
+            p = (double **) table_alloc(general, sto->vsteps, sizeof(double *));
+            p[0] = (double *) table_alloc(general, sto->vsteps * general->maxdstep, sizeof(double));
+            for (iv = 1; iv < sto->vsteps; iv++)
+                p[iv] = p[0] + iv * general->maxdstep;
+            sto->sum[iz1] = p;
+        }
+        for (iv = 0; iv < sto->vsteps; iv++) {
+            for (id = 0; id < general->maxdstep; id++) {
+                double S = 0.0;
+                for (iz2 = 1; iz2 < general->maxelements; iz2++) {
+                    if (general->element[iz2] > 0)
+                        S += conc->w[iz2][id] * sto->ele[iz1][iz2][iv];
+                }
+                if (sto->single)
+                    sto->sumf[iz1][iv][id] = (float) (S / STO_FLOAT_UNIT);
+                else
+                    sto->sum[iz1][iv][id] = S;
+            }
+        }
+    }
+}
+
+void depth_grid_uniform(DepthGrid *grid, int n, double dstep) { /* grid->d and grid->h must have n + 1 elements */
+    int i;
+    for (i = 0; i <= n; i++) {
+        grid->d[i] = i * dstep;
+        grid->h[i] = dstep;
+    }
+    grid->uniform = TRUE;
+    depth_grid_make_index(grid);
+}
+
+void depth_grid_make_index(DepthGrid *grid) {
+    /* Buckets no wider than the shortest step, so a depth is at most one step away from the step its bucket points
+     * to and depth_grid_step() is O(1). */
+    double hmin = grid->h[0];
+    int i, id = 0;
+    for (i = 1; i < grid->n; i++)
+        hmin = min(hmin, grid->h[i]);
+    grid->indexdiv = 1.0 / hmin;
+    grid->nindex = (int) (grid->d[grid->n] * grid->indexdiv) + 1;
+    if (grid->nindex > grid->maxindex) {
+        grid->indexdiv = (grid->maxindex - 1) / grid->d[grid->n];
+        grid->nindex = min((int) (grid->d[grid->n] * grid->indexdiv) + 1, grid->maxindex);
+    }
+    for (i = 0; i < grid->nindex; i++) {
+        while (id < grid->n - 1 && grid->d[id + 1] <= i / grid->indexdiv)
+            id++;
+        grid->index[i] = id;
+    }
+}
+
+int depth_grid_step(const DepthGrid *grid, double d) {
+    /* Returns step id for which d[id] <= d < d[id + 1], limited to 0..n-1 */
+    int i, id;
+    if (d <= 0.0)
+        return 0;
+    i = (int) (d * grid->indexdiv);
+    if (i >= grid->nindex)
+        return grid->n - 1;
+    id = grid->index[i];
+    while (id < grid->n - 1 && d >= grid->d[id + 1])
+        id++;
+    return id;
+}
+
+void refine_depth_grid(General *general, Stopping *sto, Concentration *conc, int remap) {
+    /* Redistributes the depth steps so that the monitor function (refinement near the surface and where the
+     * concentrations change) is equal in each step. The number of steps and the total depth are not changed. If
+     * remap is TRUE, concentrations are interpolated to the new grid and the stopping tables are recalculated. */
+    DepthGrid *grid = &conc->grid;
+    int n = general->maxdstep, id, iz2, j, k;
+    double *mon, *tmp, *cum, *dnew, *wnew, total, target, x, c;
+
+    mon = grid->scratch; /* Allocated once by allocate_general_sto_conc() */
+    tmp = mon + n;
+    cum = tmp + n;
+    dnew = cum + n + 1;
+    wnew = dnew + n + 1;
+    memset(tmp, 0, sizeof(double) * n); /* Stays zero if not remapping */
+
+    for (id = 0; id < n; id++) {
+        c = grid->d[id] + 0.5 * grid->h[id];
+        mon[id] = 1.0 + GRID_SURFACE * exp(-c / (GRID_SURFACE_DEPTH * conc->dstep));
+        if (remap && id < n - 1) {
+            double grad = 0.0, dc = 0.5 * (grid->h[id] + grid->h[id + 1]);
+            for (iz2 = 1; iz2 < general->maxelements; iz2++) {
+                if (general->element[iz2] > 0)
+                    grad += fabs(conc->w[iz2][id + 1] - conc->w[iz2][id]);
+            }
+            tmp[id] = GRID_GRADIENT * grad * conc->dstep / dc;
+        }
+    }
+    for (k = 0; k < 2; k++) { /* Smoothing of the gradient term, it is noisy */
+        for (id = 0; id < n; id++)
+            wnew[id] = 0.25 * tmp[max(id - 1, 0)] + 0.5 * tmp[id] + 0.25 * tmp[min(id + 1, n - 1)];
+        memcpy(tmp, wnew, sizeof(double) * n);
+    }
+    cum[0] = 0.0;
+    for (id = 0; id < n; id++) {
+        mon[id] = min(mon[id] + tmp[id], GRID_MAXREFINE);
+        cum[id + 1] = cum[id] + mon[id] * grid->h[id];
+    }
+    total = cum[n];
+    dnew[0] = 0.0;
+    k = 0;
+    for (j = 1; j < n; j++) {
+        target = total * j / n;
+        while (k < n - 1 && cum[k + 1] < target)
+            k++;
+        dnew[j] = grid->d[k] + (target - cum[k]) / mon[k];
+    }
+    dnew[n] = grid->d[n];
+
+    if (remap) { /* Concentrations at the middle of new steps, linear between the middle of old steps */
+        for (iz2 = 1; iz2 < general->maxelements; iz2++) {
+            if (general->element[iz2] == 0)
+                continue;
+            for (j = 0; j < n; j++) {
+                x = 0.5 * (dnew[j] + dnew[j + 1]);
+                id = depth_grid_step(grid, x);
+                if (x < grid->d[id] + 0.5 * grid->h[id])
+                    id--;
+                if (id < 0) {
+                    wnew[j] = conc->w[iz2][0];
+                } else if (id >= n - 1) {
+                    wnew[j] = conc->w[iz2][n - 1];
+                } else {
+                    c = grid->d[id] + 0.5 * grid->h[id];
+                    x = (x - c) / (grid->d[id + 1] + 0.5 * grid->h[id + 1] - c);
+                    wnew[j] = conc->w[iz2][id] + x * (conc->w[iz2][id + 1] - conc->w[iz2][id]);
+                }
+            }
+            memcpy(conc->w[iz2], wnew, sizeof(double) * n);
+        }
+    }
+
+    for (j = 0; j < n; j++) {
+        grid->d[j] = dnew[j];
+        grid->h[j] = dnew[j + 1] - dnew[j];
+    }
+    grid->h[n] = grid->h[n - 1];
+    grid->uniform = FALSE;
+    depth_grid_make_index(grid);
+
+    x = c = grid->h[0];
+    for (j = 1; j < n; j++) {
+        x = min(x, grid->h[j]);
+        c = max(c, grid->h[j]);
+    }
+    fprintf(stderr, "Depth grid refined, steps from %.2f tfu to %.2f tfu\n", x / C_TFU, c / C_TFU);
+
+    if (remap)
+        create_sumsto(general, sto, conc);
+}
+
 void clear_conc(General *general, Concentration *conc) {
     int iz2, id;
 
@@ -822,19 +1475,21 @@ void clear_conc(General *general, Concentration *conc) {
 
 void calculate_stoppings(General *general, Measurement *meas, Stopping *sto) {
     int z1, z2;
-    int s;
     for (z1 = 1; z1 < general->maxelements; z1++) {
         sto->sum[z1] = NULL;
+        sto->sumf[z1] = NULL;
         for (z2 = 1; z2 < general->maxelements; z2++) {
             sto->ele[z1][z2] = NULL;
         }
     }
     jibal_gsto *gsto = general->jibal->gsto;
+    int i, nel;
+    double *S;
+    size_t size;
     if (!gsto) {
         fprintf(stderr, "Could not init stopping table.\n");
         return;
     }
-    sto->vsteps = 1001; /* FIXME: Dynamically set parameter. Verify v_max and v_steps and everything... */
     for (z1 = 0; z1 < general->maxelements; z1++) {
         for (z2 = 0; z2 < general->maxelements; z2++) {
             if (general->element[z1] > 0 && general->element[z2] > 0) {
@@ -849,13 +1504,9 @@ void calculate_stoppings(General *general, Measurement *meas, Stopping *sto) {
     jibal_gsto_print_assignments(gsto);
     jibal_gsto_print_files(gsto, 1);
     general->vmax *= 1.2;
-    sto->vstep = general->vmax / (sto->vsteps - 1.0);
-    sto->vdiv = 1.0 / sto->vstep;
-    int i;
     for (z1 = 0; z1 < general->maxelements; z1++) {
         for (z2 = 0; z2 < general->maxelements; z2++) {
             if (general->element[z1] > 0 && general->element[z2] > 0) {
-                sto->ele[z1][z2] = malloc(sto->vsteps * sizeof(double));
                 double avgmass1 = general->jibal->elements[z1].avg_mass; /* TODO: this is an approximation. not the worst possible. */
                 double avgmass2 = general->jibal->elements[z2].avg_mass;
                 if (avgmass1 <= 0.0 || avgmass2 <= 0.0) {
@@ -866,21 +1517,99 @@ void calculate_stoppings(General *general, Measurement *meas, Stopping *sto) {
 #ifdef DEBUG
                 fprintf(stderr, "Assuming mass %g of element %i  and mass %g of element %i for nuclear stopping (%i in %i).\n", avgmass1/C_U, z1, avgmass2/C_U,  z2, z1, z2);
 #endif
-                for (i = 0; i < sto->vsteps; i++) {
-                    double v = i * sto->vstep;
-                    double em = jibal_energy_per_mass(v);
-                    sto->ele[z1][z2][i] = jibal_gsto_stop_em(gsto, z1, z2, em);
-                    if (avgmass1 > 0.0 && avgmass2 > 0.0) {
-                        sto->ele[z1][z2][i] += jibal_gsto_stop_nuclear_universal(em * avgmass1, z1, avgmass1, z2, avgmass2);
+            }
+        }
+    }
+
+    /* The number of velocity steps is doubled until linear interpolation between steps is within tolerance
+     * (relative to the highest stopping of each pair) at the middle of every step. Zero tolerance gives fixed steps. */
+    if (general->sto_tolerance > 0.0)
+        sto->vsteps = VSTEPS_MIN;
+    else
+        sto->vsteps = VSTEPS_FIXED;
+    S = (double *) malloc(sizeof(double) * max(VSTEPS_MAX, VSTEPS_FIXED));
+    if (!S) {
+        fprintf(stderr, "Could not allocate stopping tables.\n");
+        exit(9);
+    }
+    while (1) {
+        double err, errmax = 0.0;
+        sto->vstep = general->vmax / (sto->vsteps - 1.0);
+        sto->vdiv = 1.0 / sto->vstep;
+        for (z1 = 0; z1 < general->maxelements; z1++) {
+            for (z2 = 0; z2 < general->maxelements; z2++) {
+                if (general->element[z1] > 0 && general->element[z2] > 0) {
+                    double Smax = 0.0;
+                    for (i = 0; i < sto->vsteps; i++) {
+                        S[i] = stopping_ele(general, z1, z2, i * sto->vstep);
+                        Smax = max(Smax, S[i]);
+                    }
+                    if (general->sto_tolerance <= 0.0 || Smax <= 0.0)
+                        continue;
+                    for (i = 0; i < sto->vsteps - 1; i++) {
+                        err = fabs(0.5 * (S[i] + S[i + 1]) - stopping_ele(general, z1, z2, (i + 0.5) * sto->vstep));
+                        errmax = max(errmax, err / Smax);
                     }
                 }
             }
         }
+        if (general->sto_tolerance <= 0.0 || errmax <= general->sto_tolerance || sto->vsteps >= VSTEPS_MAX) {
+            fprintf(stderr, "Stopping tables have %i velocity steps, interpolation error %.2e\n", sto->vsteps, errmax);
+            break;
+        }
+        sto->vsteps = 2 * sto->vsteps - 1;
+    }
+    free(S);
+
+    /* Final tables, followed by the concentration weighted sums (both precisions when comparing) */
+    nel = 0;
+    for (z1 = 0; z1 < general->maxelements; z1++) {
+        if (general->element[z1] > 0)
+            nel++;
+    }
+    size = nel * nel * arena_aligned_size(sto->vsteps * sizeof(double));
+    size += nel * (arena_aligned_size(sto->vsteps * sizeof(double *)) +
+                   arena_aligned_size(sto->vsteps * general->maxdstep * sizeof(double)));
+    if (general->precision != PRECISION_DOUBLE) {
+        size += nel * (arena_aligned_size(sto->vsteps * sizeof(float *)) +
+                       arena_aligned_size(sto->vsteps * general->maxdstep * sizeof(float)));
+    }
+    if (arena_reserve(general->arena, size)) {
+        fprintf(stderr, "Could not allocate stopping tables.\n");
+        exit(9);
+    }
+    for (z1 = 0; z1 < general->maxelements; z1++) {
+        for (z2 = 0; z2 < general->maxelements; z2++) {
+            if (general->element[z1] > 0 && general->element[z2] > 0) {
+                sto->ele[z1][z2] = (double *) table_alloc(general, sto->vsteps, sizeof(double));
+                for (i = 0; i < sto->vsteps; i++)
+                    sto->ele[z1][z2][i] = stopping_ele(general, z1, z2, i * sto->vstep);
+            }
+        }
     }
 }
 
+double stopping_ele(General *general, int z1, int z2, double v) {
+    /* Electronic and nuclear stopping of z1 in z2 at velocity v */
+    double avgmass1 = general->jibal->elements[z1].avg_mass;
+    double avgmass2 = general->jibal->elements[z2].avg_mass;
+    double em = jibal_energy_per_mass(v);
+    double S = jibal_gsto_stop_em(general->jibal->gsto, z1, z2, em);
+    if (avgmass1 > 0.0 && avgmass2 > 0.0) {
+        S += jibal_gsto_stop_nuclear_universal(em * avgmass1, z1, avgmass1, z2, avgmass2);
+    }
+    return S;
+}
+
 void read_command_line(int argc, char *argv[], General *general) {
 
+    general->rebin = FALSE;
+    if (argc > 1 && !strcmp(argv[1], "--rebin")) { /* The event file is a saved depths file */
+        general->rebin = TRUE;
+        argc--;
+        argv++;
+    }
+
     if (argc > 1)
         strcpy(general->prefix, argv[1]);
     else
@@ -911,16 +1640,28 @@ void read_setup(General *general, Measurement *meas, Concentration *conc) {
     FILE *fp;
     char buf[NLINE], *value, beam[NELESYM];
     double v_beam;
-    int cont = TRUE, c, i;
+    int cont = TRUE, c, i, k;
 
     general->vmax = 0.0;
     conc->dstep = 100 * C_TFU;
     conc->density = 5.0 * C_G_CM3;
     general->scale = FALSE;
     general->niter = NITER;
+    general->ordering = ORDER_COST;
+    general->integrator = INTEGRATOR_TRAPEZOID;
+    general->eloss_tolerance = ELOSS_TOLERANCE;
+    general->depthgrid = GRID_UNIFORM;
+    general->sto_tolerance = STO_TOLERANCE;
+    general->precision = PRECISION_DOUBLE;
+    general->compact = FALSE;
+    general->memlimit = 0.0;
+    general->outformat = OUTPUT_TEXT;
+    general->noutsteps = 0;
+    memset(&general->sweep, 0, sizeof(SweepGrid));
+    meas->detector_offset = 0.0;
+    general->savedepths = FALSE;
     general->maxdstep = MAXDSTEP;
     general->maxelements = MAXELEMENTS;
-    general->maxnucmasses = MAXNUCMASSES;
 
     fp = fopen(general->setupfile, "r");
 
@@ -972,11 +1713,11 @@ void read_setup(General *general, Measurement *meas, Concentration *conc) {
             conc->dstep *= C_TFU;
         }
         value = read_inputline(buf, I_OUTSTEP);
-        if (value != NULL) {
-            c = sscanf(value, "%lf", &(general->outstep));
-            if (c != 1)
+        if (value != NULL) { /* One or more steps */
+            general->noutsteps = read_list(value, general->outsteps, MAXOUTSTEPS, C_TFU);
+            if (general->noutsteps <= 0)
                 file_error(general->setupfile, i + 1);
-            general->outstep *= C_TFU;
+            general->outstep = general->outsteps[0];
         }
         value = read_inputline(buf, I_DENSITY);
         if (value != NULL) {
@@ -997,7 +1738,7 @@ void read_setup(General *general, Measurement *meas, Concentration *conc) {
         value = read_inputline(buf, I_CROSS_SECTION);
         if (value != NULL) {
             c = sscanf(value, "%i", (int *) &(general->cs));
-            if (c != 1)
+            if (c != 1 || general->cs < CS_NONE || general->cs > CS_ANDERSEN)
                 file_error(general->setupfile, i + 1);
         }
         value = read_inputline(buf, I_MAXDSTEP);
@@ -1012,9 +1753,97 @@ void read_setup(General *general, Measurement *meas, Concentration *conc) {
             if (c != 1)
                 file_error(general->setupfile, i + 1);
         }
+        value = read_inputline(buf, I_INTEGRATOR);
+        if (value != NULL) {
+            c = sscanf(value, "%i", (int *) &(general->integrator));
+            if (c != 1)
+                file_error(general->setupfile, i + 1);
+        }
+        value = read_inputline(buf, I_TOLERANCE);
+        if (value != NULL) {
+            c = sscanf(value, "%lf", &(general->eloss_tolerance));
+            if (c != 1 || general->eloss_tolerance <= 0.0)
+                file_error(general->setupfile, i + 1);
+            general->eloss_tolerance *= C_KEV;
+        }
+        value = read_inputline(buf, I_DEPTHGRID);
+        if (value != NULL) {
+            c = sscanf(value, "%i", (int *) &(general->depthgrid));
+            if (c != 1)
+                file_error(general->setupfile, i + 1);
+        }
+        value = read_inputline(buf, I_STOTOLERANCE);
+        if (value != NULL) {
+            c = sscanf(value, "%lf", &(general->sto_tolerance));
+            if (c != 1)
+                file_error(general->setupfile, i + 1);
+        }
+        value = read_inputline(buf, I_PRECISION);
+        if (value != NULL) {
+            c = sscanf(value, "%i", (int *) &(general->precision));
+            if (c != 1)
+                file_error(general->setupfile, i + 1);
+        }
+        value = read_inputline(buf, I_COMPACT);
+        if (value != NULL) {
+            c = sscanf(value, "%i", &(general->compact));
+            if (c != 1)
+                file_error(general->setupfile, i + 1);
+        }
+        value = read_inputline(buf, I_MEMLIMIT);
+        if (value != NULL) {
+            c = sscanf(value, "%lf", &(general->memlimit));
+            if (c != 1 || general->memlimit < 0.0)
+                file_error(general->setupfile, i + 1);
+            general->memlimit *= 1.0e6; /* MB */
+        }
+        value = read_inputline(buf, I_OUTFORMAT);
+        if (value != NULL) {
+            c = sscanf(value, "%i", (int *) &(general->outformat));
+            if (c != 1 || general->outformat < OUTPUT_TEXT || general->outformat > OUTPUT_BOTH)
+                file_error(general->setupfile, i + 1);
+        }
+        value = read_inputline(buf, I_SAVEDEPTHS);
+        if (value != NULL) {
+            c = sscanf(value, "%i", &(general->savedepths));
+            if (c != 1)
+                file_error(general->setupfile, i + 1);
+        }
+        for (k = 0; k < SWEEP_AXES; k++) {
+            static const int sweep_lines[SWEEP_AXES] = {I_SWEEP_TARANGLE, I_SWEEP_DETOFFSET, I_SWEEP_CROSS_SECTION,
+                                                        I_SWEEP_DENSITY};
+            static const double sweep_units[SWEEP_AXES] = {C_DEG, C_DEG, 1.0, C_G_CM3};
+            value = read_inputline(buf, sweep_lines[k]);
+            if (value != NULL) {
+                general->sweep.n[k] = read_list(value, general->sweep.value[k], MAXSWEEP, sweep_units[k]);
+                if (general->sweep.n[k] <= 0)
+                    file_error(general->setupfile, i + 1);
+                for (int j = 0; k == SWEEP_CROSS_SECTION && j < general->sweep.n[k]; j++) {
+                    double cs = general->sweep.value[k][j]; /* Same values as "Cross section:" */
+                    if (cs != floor(cs) || cs < CS_NONE || cs > CS_ANDERSEN)
+                        file_error(general->setupfile, i + 1);
+                }
+                general->sweep.active = TRUE;
+            }
+        }
+        value = read_inputline(buf, I_ORDER);
+        if (value != NULL) {
+            c = sscanf(value, "%i", (int *) &(general->ordering));
+            if (c != 1 || general->ordering < ORDER_COST || general->ordering > ORDER_LOCALITY)
+                file_error(general->setupfile, i + 1);
+        }
         i++;
     }
 
+    if (general->noutsteps == 0) {
+        fprintf(stderr, "No depth step for output in setup file %s\n", general->setupfile);
+        exit(3);
+    }
+    if (general->rebin && general->sweep.active) {
+        fprintf(stderr, "Sweep in setup file %s can not be used with saved depths (--rebin)\n", general->setupfile);
+        exit(3);
+    }
+
     v_beam = sqrt((2.0 * meas->E) / meas->M);
     if (v_beam > general->vmax)
         general->vmax = v_beam;
@@ -1022,6 +1851,24 @@ void read_setup(General *general, Measurement *meas, Concentration *conc) {
     fclose(fp);
 }
 
+int read_list(const char *value, double *list, int nmax, double unit) {
+    /* Reads numbers separated by whitespace, multiplied by unit. Returns the number of values, -1 if there are more
+     * than nmax. */
+    char *end;
+    int n = 0;
+    while (n < nmax) {
+        double x = strtod(value, &end);
+        if (end == value)
+            break;
+        list[n++] = x * unit;
+        value = end;
+    }
+    strtod(value, &end);
+    if (end != value)
+        return -1;
+    return n;
+}
+
 char *read_inputline(char *buf, int input_type) {
     char *p;
 
@@ -1040,82 +1887,406 @@ void file_error(char *fname, int line) {
 
 }
 
-void read_events(General *general, Measurement *meas, Event *event,
-                 Concentration *conc) {
+void read_events(General *general, Measurement *meas, Events *events) {
     FILE *fp;
     char buf[NLINE], type[TYPELEN + 1];
     double x, y, E, M, w;
-    int c, Z, A, n, i = 0, cont = TRUE, j, k;
+    int c, Z, n, i = 0, t;
+    EventSink sink;
 
     if (!strncmp(general->eventfile, "-", 1) && strlen(general->eventfile) == 1)
-        fp = stdin;
+        fp = decompress_stream(stdin);
     else
-        fp = fopen(general->eventfile, "r");
+        fp = decompress_fopen(general->eventfile); /* gzip and zstd compressed files are decompressed on the fly */
 
     if (fp == NULL) {
         fprintf(stderr, "Could not open file %s\n", general->eventfile);
         exit(1);
     }
 
-    while (fgets(buf, NLINE, fp) != NULL && cont) {
+    events_begin(&sink, general, meas, events);
+    while (fgets(buf, NLINE, fp) != NULL) {
         c = sscanf(buf, "%lf %lf %lf %i %lf %s %lf %i",
                    &x, &y, &E, &Z, &M, type, &w, &n);
         if (c != 8) {
             fprintf(stderr, "Problems at input line %i\n", i + 1);
         }
-        if (i < MAXEVENTS) {
-            event[i].theta = meas->detector_angle + x;
-            event[i].fii = y;
-            event[i].E = E * C_MEV;
-            event[i].Z = Z;
-#ifdef DEBUG
-            printf("%5i %10.3f %10.3f\n",Z,event[i].theta/C_DEG,event[i].E/C_MEV);
-#endif
-            event[i].M = M * C_U;
-            event[i].A = (int) (M + 0.5);
-            A = event[i].A;
-            event[i].w0 = w;
-            event[i].w = w / ipow2(Z * (1.0 + meas->M / event[i].M));
-            event[i].n = n;
-            event[i].v = sqrt(2.0 * event[i].E / event[i].M);
-            if (event[i].v > general->vmax)
-                general->vmax = event[i].v;
-            event[i].d = 0.0;
-            k = (int) (event[i].d / conc->dstep);
-            conc->w[Z][k] += event[i].w;
-            conc->n[Z][k]++;
-            conc->wsum[k] += event[i].w;
-            conc->nsum[k]++;
-            (general->element[Z])++;
-            (general->nuclide[Z][A])++;
-            general->M[Z] = M * C_U;
-            if (!strncmp(type, "ERD", TYPELEN)) {
-                event[i].type = ERD;
-            } else if (!strncmp(type, "RBS", TYPELEN)) {
-                event[i].type = RBS;
-            } else {
-                fprintf(stderr, "Event type neither ERD nor RBS!\n");
-                exit(2);
-            }
-            i++;
+        if (!strncmp(type, "ERD", TYPELEN)) {
+            t = ERD;
+        } else if (!strncmp(type, "RBS", TYPELEN)) {
+            t = RBS;
         } else {
-            cont = FALSE;
+            fprintf(stderr, "Event type neither ERD nor RBS!\n");
+            exit(2);
+        }
+        if (!events_add(&sink, x, y, E * C_MEV, Z, M * C_U, t, w, n)) {
             fprintf(stderr, "Too many events, reading stopped at line %i\n", i + 1);
+            break;
         }
+        i++;
     }
-    fclose(fp);
-    general->nevents = i;
+    if (decompress_fclose(fp)) {
+        fprintf(stderr, "Could not read all events from %s\n", general->eventfile);
+        exit(1);
+    }
+    events_end(&sink);
+}
+
+void events_begin(EventSink *sink, General *general, Measurement *meas, Events *events) {
+    sink->general = general;
+    sink->meas = meas;
+    sink->events = events;
+    sink->nuclide = NULL;
+    sink->nalloc = 0;
+    sink->n = 0;
+}
 
-/* We calculate the number of different isotopes for each element */
+static int events_next(EventSink *sink, int Z, double M) {
+    /* Makes room for the next event (sink->n) of element Z and mass M. Returns the index of its nuclide or -1 if there
+     * is no room for more events. */
+    General *general = sink->general;
+    Events *events = sink->events;
+    int i = sink->n, nuc;
+
+    if (i >= MAXEVENTS)
+        return -1;
+    if (Z < 1 || Z >= general->maxelements) { /* Element tables are indexed by Z */
+        fprintf(stderr, "Event %i has Z = %i, only 1 <= Z < %i is supported.\n", i + 1, Z, general->maxelements);
+        exit(2);
+    }
+    if (!events->spill && general->memlimit > 0.0 &&
+        (i + 1.0) * ((events->compact ? sizeof(CompactEvent) : sizeof(Event)) + sizeof(int)) > general->memlimit)
+        events_spill(general, events, i);
+    events_grow(events, i + 1);
+    nuc = nuclide_add(&sink->nuclide, &general->nnuclides, &sink->nalloc, Z, (int) (M / C_U + 0.5), M);
+    if (events->compact && general->nnuclides > USHRT_MAX + 1) { /* Z fits, since maxelements is less than 256 */
+        fprintf(stderr, "Event %i can not be stored in compact form.\n", i + 1);
+        exit(2);
+    }
+    return nuc;
+}
 
-    for (i = 0; i < general->maxelements; i++) {
-        for (j = 1; j < general->maxnucmasses; j++)
-            if (general->nuclide[i][j] > 0)
-                (general->nuclide[i][0])++;
+static void events_put_compact(EventSink *sink, const CompactEvent *ev) {
+    Events *events = sink->events;
+    if (!events->spill) {
+        events->cevent[sink->n] = *ev;
+    } else if (fwrite(ev, sizeof(CompactEvent), 1, events->spillfile) != 1) {
+        fprintf(stderr, "Could not write to spill file.\n");
+        exit(6);
+    }
+}
+
+int events_add(EventSink *sink, double x, double y, double E, int Z, double M, int t, double w, int n) {
+    /* Adds an event. Angle x is relative to the detector angle, E and M are in SI units, t is ERD or RBS and n is the
+     * event number. Returns FALSE if there is no room for more events. */
+    General *general = sink->general;
+    Measurement *meas = sink->meas;
+    Events *events = sink->events;
+    int i = sink->n, nuc;
+    double v;
+
+    nuc = events_next(sink, Z, M);
+    if (nuc < 0)
+        return FALSE;
+#ifdef DEBUG
+    printf("%5i %10.3f %10.3f\n",Z,(meas->detector_angle + x)/C_DEG,E/C_MEV);
+#endif
+    v = sqrt(2.0 * E / M);
+    if (v > general->vmax)
+        general->vmax = v;
+    (general->element[Z])++;
+    general->M[Z] = M;
+    if (events->compact) {
+        CompactEvent ev;
+        ev.theta = (float) (meas->detector_angle + x);
+        ev.E = (float) E;
+        ev.w0 = (float) w;
+        ev.w = 0.0f;
+        ev.d = 0.0f;
+        ev.type = t;
+        ev.Z = Z;
+        ev.nuc = nuc;
+        events_put_compact(sink, &ev);
+    } else {
+        Event *ev = &events->event[i];
+        ev->theta = meas->detector_angle + x;
+        ev->fii = y;
+        ev->E = E;
+        ev->Z = Z;
+        ev->M = M;
+        ev->w0 = w;
+        ev->w = 0.0;
+        ev->d = 0.0;
+        ev->n = n;
+        ev->v = v;
+        ev->type = t;
+        ev->nuc = nuc;
+    }
+    sink->n++;
+    return TRUE;
+}
+
+int events_add_depth(EventSink *sink, int Z, double M, double d, double w, int n) {
+    /* Adds an event whose depth d and weight w are already known (see read_depths()). Only what output() needs is
+     * stored: angles and energy are zero and the event doesn't count in the element tables or general->vmax. Returns
+     * FALSE if there is no room for more events. */
+    Events *events = sink->events;
+    int nuc;
+
+    nuc = events_next(sink, Z, M);
+    if (nuc < 0)
+        return FALSE;
+    if (events->compact) {
+        CompactEvent ev;
+        memset(&ev, 0, sizeof(CompactEvent));
+        ev.w0 = (float) w;
+        ev.w = (float) w;
+        ev.d = (float) d;
+        ev.type = ERD;
+        ev.Z = Z;
+        ev.nuc = nuc;
+        events_put_compact(sink, &ev);
+    } else {
+        Event *ev = &events->event[sink->n];
+        memset(ev, 0, sizeof(Event));
+        ev->Z = Z;
+        ev->M = M;
+        ev->w0 = w;
+        ev->w = w;
+        ev->d = d;
+        ev->n = n;
+        ev->type = ERD;
+        ev->nuc = nuc;
+    }
+    sink->n++;
+    return TRUE;
+}
+
+void events_end(EventSink *sink) {
+    General *general = sink->general;
+    Events *events = sink->events;
+    int i;
+
+    general->nevents = sink->n;
+    if (events->spill) {
+        events_map(events, general->nevents);
+        general->order = NULL;
+    } else {
+        general->order = (int *) table_alloc(general, max(general->nevents, 1), sizeof(int));
+        for (i = 0; i < general->nevents; i++) /* File order until the events are ordered */
+            general->order[i] = i;
     }
 
+/* Nuclides are moved to the arena and sorted, events point to them by index */
+
+    general->nuclide = (Nuclide *) table_alloc(general, max(general->nnuclides, 1), sizeof(Nuclide));
+    if (general->nnuclides)
+        memcpy(general->nuclide, sink->nuclide, sizeof(Nuclide) * general->nnuclides);
+    free(sink->nuclide);
+    sink->nuclide = NULL;
+    nuclide_index(general, events);
+    events->nuclide = general->nuclide;
+
     fprintf(stderr, "%i events read\n", general->nevents);
+    if (events->spill) {
+        fprintf(stderr, "Events take %i bytes each, %.1lf MB in total, streamed from the spill file\n",
+                (int) sizeof(CompactEvent), general->nevents * (double) sizeof(CompactEvent) / 1.0e6);
+    } else {
+        fprintf(stderr, "Events take %i bytes each, %.1lf MB in total\n",
+                (int) ((events->compact ? sizeof(CompactEvent) : sizeof(Event)) + sizeof(int)),
+                general->nevents * (double) ((events->compact ? sizeof(CompactEvent) : sizeof(Event)) + sizeof(int)) / 1.0e6);
+    }
+
+}
+
+void events_grow(Events *events, int n) {
+    /* Makes room for at least n events */
+    int nalloc;
+    if (events->spill || n <= events->nalloc)
+        return;
+    nalloc = max(n, min(2 * (long) events->nalloc, MAXEVENTS));
+    nalloc = max(nalloc, EVENTS_INITIAL_ALLOC);
+    if (events->compact)
+        events->cevent = (CompactEvent *) realloc(events->cevent, sizeof(CompactEvent) * nalloc);
+    else
+        events->event = (Event *) realloc(events->event, sizeof(Event) * nalloc);
+    if (events->compact ? !events->cevent : !events->event) {
+        fprintf(stderr, "Could not allocate memory for %i events.\n", nalloc);
+        exit(9);
+    }
+    events->nalloc = nalloc;
+}
+
+void events_spill(General *general, Events *events, int n) {
+    /* Moves the n events read so far to a spill file, the rest of the events are written there as they are read. The
+     * file is unlinked right away, so it is removed when erd_depth exits. */
+#ifdef WIN32
+    fprintf(stderr, "Memory limit exceeded, streaming events from disk is not supported on this platform.\n");
+    general->memlimit = 0.0;
+#else
+    char fname[NAMELEN];
+    int i;
+    if (snprintf(fname, NAMELEN, "%s.spill", general->prefix) >= NAMELEN) {
+        fprintf(stderr, "Output prefix %s is too long\n", general->prefix);
+        exit(6);
+    }
+    events->spillfile = fopen(fname, "w+b");
+    if (!events->spillfile) {
+        fprintf(stderr, "Could not open spill file %s\n", fname);
+        exit(6);
+    }
+    unlink(fname);
+    fprintf(stderr, "Memory limit of %.1lf MB exceeded after %i events, streaming events through spill file %s\n",
+            general->memlimit / 1.0e6, n, fname);
+    if (!events->compact)
+        fprintf(stderr, "WARNING: all events are converted to compact form (single precision, one mass for each "
+                        "nuclide), results may differ from a run without the memory limit\n");
+    if (general->nnuclides > USHRT_MAX + 1) {
+        fprintf(stderr, "Too many nuclides to store events in compact form.\n");
+        exit(2);
+    }
+    for (i = 0; i < n; i++) {
+        CompactEvent ev;
+        if (events->compact) {
+            ev = events->cevent[i];
+        } else {
+            const Event *full = &events->event[i];
+            ev.theta = (float) full->theta;
+            ev.E = (float) full->E;
+            ev.w0 = (float) full->w0;
+            ev.w = (float) full->w; /* Known already for events of saved depths */
+            ev.d = (float) full->d;
+            ev.type = full->type;
+            ev.Z = full->Z;
+            ev.nuc = full->nuc;
+        }
+        if (fwrite(&ev, sizeof(CompactEvent), 1, events->spillfile) != 1) {
+            fprintf(stderr, "Could not write to spill file %s\n", fname);
+            exit(6);
+        }
+    }
+    free(events->event);
+    free(events->cevent);
+    events->event = NULL;
+    events->cevent = NULL;
+    events->nalloc = 0;
+    events->compact = TRUE;
+    events->spill = TRUE;
+#endif
+}
 
+void events_map(Events *events, int n) {
+    /* Maps the spill file of n events, changes to the events are written back to the file */
+#ifndef WIN32
+    events->maplen = sizeof(CompactEvent) * max(n, 1);
+    if (fflush(events->spillfile)) {
+        fprintf(stderr, "Could not write to spill file.\n");
+        exit(6);
+    }
+    events->cevent = (CompactEvent *) mmap(NULL, events->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                           fileno(events->spillfile), 0);
+    if (events->cevent == MAP_FAILED) {
+        fprintf(stderr, "Could not map spill file.\n");
+        exit(9);
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(events->cevent, events->maplen, MADV_SEQUENTIAL);
+#endif
+    events->nalloc = n;
+#endif
+}
+
+void events_free(Events *events) {
+#ifndef WIN32
+    if (events->spill) {
+        munmap(events->cevent, events->maplen);
+        fclose(events->spillfile);
+        events->cevent = NULL;
+    }
+#endif
+    free(events->event);
+    free(events->cevent);
+    events->event = NULL;
+    events->cevent = NULL;
+    events->nalloc = 0;
+}
+
+int nuclide_add(Nuclide **nuclide, int *n, int *nalloc, int Z, int A, double M) {
+    /* Returns index of nuclide (Z, A) in the table, adding it if it is not there. The table is in order of
+     * appearance, there are only a few nuclides so a linear search will do. */
+    int i;
+    for (i = 0; i < *n; i++) {
+        if ((*nuclide)[i].Z == Z && (*nuclide)[i].A == A)
+            break;
+    }
+    if (i == *n) {
+        if (*n == *nalloc) {
+            *nalloc = max(2 * *nalloc, 16);
+            *nuclide = (Nuclide *) realloc(*nuclide, sizeof(Nuclide) * *nalloc);
+            if (!*nuclide) {
+                fprintf(stderr, "Could not allocate nuclide table.\n");
+                exit(9);
+            }
+        }
+        (*nuclide)[i].Z = Z;
+        (*nuclide)[i].A = A;
+        (*nuclide)[i].M = M;
+        (*nuclide)[i].nevents = 0;
+        (*n)++;
+    }
+    (*nuclide)[i].nevents++;
+    return i;
+}
+
+void nuclide_index(General *general, Events *events) {
+    /* Sorts nuclides by Z and A, renumbers events accordingly and makes the per element index nucstart */
+    int i, j, *renum, *perm;
+    Nuclide tmp;
+    renum = (int *) malloc(sizeof(int) * max(general->nnuclides, 1));
+    perm = (int *) malloc(sizeof(int) * max(general->nnuclides, 1));
+    for (i = 0; i < general->nnuclides; i++)
+        perm[i] = i;
+    for (i = 1; i < general->nnuclides; i++) { /* Insertion sort, there are only a few nuclides */
+        int p = perm[i];
+        tmp = general->nuclide[i];
+        for (j = i; j > 0 && (general->nuclide[j - 1].Z > tmp.Z ||
+                             (general->nuclide[j - 1].Z == tmp.Z && general->nuclide[j - 1].A > tmp.A)); j--) {
+            general->nuclide[j] = general->nuclide[j - 1];
+            perm[j] = perm[j - 1];
+        }
+        general->nuclide[j] = tmp;
+        perm[j] = p;
+    }
+    for (i = 0; i < general->nnuclides; i++)
+        renum[perm[i]] = i;
+    for (i = 0; i < general->nevents; i++) {
+        if (events->compact)
+            events->cevent[i].nuc = renum[events->cevent[i].nuc];
+        else
+            events->event[i].nuc = renum[events->event[i].nuc];
+    }
+    for (i = 0, j = 0; i <= general->maxelements; i++) {
+        while (j < general->nnuclides && general->nuclide[j].Z < i)
+            j++;
+        general->nucstart[i] = j;
+    }
+    free(renum);
+    free(perm);
+}
+
+void reset_events(General *general, Measurement *meas, Events *events, Concentration *conc) {
+    /* Initial state of the iteration: all events at the surface, weighted by the Rutherford cross section */
+    int i, k, Z;
+    clear_conc(general, conc);
+    for (i = 0; i < general->nevents; i++) {
+        Z = event_Z(events, i);
+        event_set(events, i, 0.0, event_w0(events, i) / ipow2(Z * (1.0 + meas->M / event_M(events, i))), 0);
+        k = 0;
+        conc->w[Z][k] += event_w(events, i);
+        conc->n[Z][k]++;
+        conc->wsum[k] += event_w(events, i);
+        conc->nsum[k]++;
+    }
 }
 
 double ipow(double x, int a) {
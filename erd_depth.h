@@ -0,0 +1,361 @@
+#ifndef ERD_DEPTH_H
+#define ERD_DEPTH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <jibal.h>
+
+#include "arena.h"
+
+#define NAMELEN 1000 /* This is the maximum length for a filename. FIXME: Dynamic length! */
+#define MAXOUTSTEPS 16 /* Maximum number of output depth steps */
+#define MAXSWEEP 64 /* Maximum number of values of one swept parameter */
+#define ERD 1
+#define RBS 2
+#define TRUE  1
+#define FALSE 0
+
+enum cross_section {
+    CS_NONE = 0,
+    CS_RUTHERFORD = 1,
+    CS_LECUYER = 2,
+    CS_ANDERSEN = 3
+};
+
+enum integrator {
+    INTEGRATOR_TRAPEZOID = 0,
+    INTEGRATOR_RK23 = 1
+};
+
+enum depth_grid {
+    GRID_UNIFORM = 0,
+    GRID_ADAPTIVE = 1
+};
+
+enum precision {
+    PRECISION_DOUBLE = 0,
+    PRECISION_SINGLE = 1,
+    PRECISION_COMPARE = 2 /* Run with both, report differences */
+};
+
+enum output_format {
+    OUTPUT_TEXT = 0, /* One text file for each nuclide and the total */
+    OUTPUT_BINARY = 1, /* All profiles in one columnar binary file, see profiles.h */
+    OUTPUT_BOTH = 2
+};
+
+enum event_order {
+    ORDER_COST = 0,
+    ORDER_LOCALITY = 1
+};
+
+typedef struct {
+    double theta;
+    double fii;
+    double E;
+    double v;
+    int type;
+    int n;
+    int Z;
+    int nuc; /* Index to general->nuclide */
+    double M;
+    double w0;
+    double w;
+    double d;
+    int id;
+    int cost; /* Number of depth steps taken on previous iteration, used for scheduling */
+} Event;
+
+typedef struct {
+    int Z;
+    int A;
+    double M; /* Mass of the first event of the nuclide */
+    int nevents;
+} Nuclide;
+
+typedef struct {
+    float theta;
+    float E;
+    float w0;
+    float w;
+    float d;
+    unsigned char type;
+    unsigned char Z;
+    unsigned short nuc; /* Index to general->nuclide, the mass of the event is the mass of the nuclide */
+} CompactEvent;
+
+_Static_assert(sizeof(CompactEvent) == 24, "CompactEvent should be 24 bytes, spill files are arrays of them");
+
+/* Events are stored either as Event (88 bytes) or as CompactEvent (24 bytes). Both also take 4 bytes in
+ * general->order, so the memory footprint is 28 bytes per compact event and 92 bytes per full event. Inputs and results
+ * of compact events are single precision, calculations are always done in double precision.
+ *
+ * If the events would take more than the memory limit, they are streamed to a spill file as CompactEvents and the
+ * file is memory mapped. Depths and weights are written back to the file, events are processed in file order and
+ * only the histograms are kept in memory. */
+typedef struct {
+    int compact; /* Events are stored in cevent instead of event */
+    int spill; /* cevent is a memory mapped spill file */
+    int nalloc;
+    Event *event; /* event[0..nalloc] */
+    CompactEvent *cevent; /* cevent[0..nalloc] */
+    const Nuclide *nuclide; /* general->nuclide, for the masses of compact events */
+    FILE *spillfile;
+    size_t maplen;
+} Events;
+
+typedef struct {
+    int Z;
+    int A;
+    double M;
+    double E;
+    double detector_angle;
+    double target_angle;
+    double detector_offset; /* Added to the angles of all events, only changed by sweep() */
+} Measurement;
+
+enum sweep_axis { /* The last one changes fastest in sweep() */
+    SWEEP_TARGET_ANGLE = 0,
+    SWEEP_DETECTOR_OFFSET = 1,
+    SWEEP_CROSS_SECTION = 2,
+    SWEEP_DENSITY = 3, /* Depths don't depend on density, they are only calculated when other parameters change */
+    SWEEP_AXES = 4
+};
+
+typedef struct { /* Parameter grid of sweep(), in SI units */
+    int active; /* At least one parameter is swept */
+    int n[SWEEP_AXES]; /* Number of values of each parameter, 0 if it is not swept */
+    double value[SWEEP_AXES][MAXSWEEP];
+} SweepGrid;
+
+typedef struct {
+    jibal *jibal;
+    arena *arena; /* Owns all tables of the run, see table_alloc() */
+    char eventfile[NAMELEN];
+    char setupfile[NAMELEN];
+    int nevents;
+    int *order; /* order[0..nevents], processing order of events in the depth calculation. NULL for file order. */
+    double vmax;
+    int *element; /* element[0..maxelements] */
+    Nuclide *nuclide; /* nuclide[0..nnuclides], nuclides found in the events in order of Z and A */
+    int nnuclides;
+    int *nucstart; /* nucstart[0..maxelements], nuclides of element Z are nucstart[Z]..nucstart[Z + 1] - 1 */
+    char prefix[NAMELEN];
+    double *M; /* M[0..maxelements] */
+    double outstep; /* First of outsteps */
+    double outsteps[MAXOUTSTEPS]; /* Output profiles are made at each of these depth steps */
+    int noutsteps;
+    enum output_format outformat;
+    int savedepths; /* Write final depths of events to <prefix>.depths */
+    int rebin; /* Only make profiles from a saved depths file (--rebin) */
+    SweepGrid sweep;
+    double minscale, maxscale;
+    int scale;
+    enum cross_section cs;
+    enum event_order ordering;
+    enum integrator integrator;
+    double eloss_tolerance;
+    enum depth_grid depthgrid;
+    double sto_tolerance;
+    enum precision precision;
+    int compact; /* "Compact events:", store events as CompactEvent. Angle, energy, weights and depth are single
+                  * precision and masses are not stored per event: all events of a nuclide (Z, A) get the mass of its
+                  * first event. Input with different masses for the same Z and A loses them. */
+    double memlimit; /* Events are streamed from disk if they would take more memory than this, 0 is no limit. Only
+                      * events and general->order are counted, histograms and other tables come on top of the limit.
+                      * Streamed events are always compact. */
+    int maxdstep;
+    int maxelements;
+    int niter;
+} General;
+
+typedef struct {
+    int n; /* Number of depth steps */
+    int uniform; /* All steps are equal, d[i] = i*h[0] */
+    double *d; /* d[0..n], depth at the start of each step, d[n] is the end of the grid */
+    double *h; /* h[0..n], length of each step */
+    int *index; /* index[0..nindex], step containing depth i/indexdiv */
+    int nindex;
+    int maxindex; /* Allocated size of index */
+    double indexdiv;
+    double *scratch; /* scratch[0..5*n+1], work space of refine_depth_grid(), NULL if the grid is not adaptive */
+} DepthGrid;
+
+typedef struct {
+    double vstep;
+    int vsteps;
+    double dstep;
+    double vdiv;
+    double ddiv;
+    DepthGrid *grid;
+    double ***ele; /* ele[0..maxelements][0..maxelements][0..vsteps] */
+    double ***sum; /* sum[0..maxelements][0..vsteps][0..maxdstep], each element is one contiguous block */
+    int single; /* Use sumf instead of sum */
+    float ***sumf; /* Single precision version of sum, in units of STO_FLOAT_UNIT */
+} Stopping;
+
+typedef struct {
+    double dstep;
+    double dmax;
+    DepthGrid grid;
+    double **w; /* w[0..maxelements][0..maxdstep], rows are contiguous and followed by wsum */
+    int **n; /* n[0..maxelements][0..maxdstep], rows are contiguous and followed by nsum */
+    double *wsum; /* wsum[0..maxdstep], sum of w over elements */
+    double *mass; /* mass[0..maxdstep], allocated but not used */
+    int *nsum; /* nsum[0..maxdstep], sum of n over elements */
+    double *Ebeam;
+    double density;
+    double *wprofile; /* wprofile[0..nnuclides*nprofile], one contiguous row for each nuclide */
+    int *nprofile; /* nprofile[0..nnuclides*nprofile] */
+    double *wprofsum;
+    double *profmass;
+    int *nprofsum;
+} Concentration;
+
+typedef struct {
+    int nrows; /* The last row is the sum of all other rows */
+    int nbins;
+    double *w; /* w[0..nrows*nbins] */
+    int *n; /* n[0..nrows*nbins] */
+    double *m; /* m[0..nbins], mass weighted sum row. May be NULL. */
+} Histogram;
+
+typedef struct { /* Final result of one event, see save_depths() */
+    int32_t Z;
+    int32_t A;
+    double M; /* in kg */
+    double d; /* in atoms/m2 */
+    double w;
+} SavedEvent;
+
+typedef struct { /* Events are added one by one from a file (read_events()) or from other sources (erd_pipeline) */
+    General *general;
+    Measurement *meas;
+    Events *events;
+    Nuclide *nuclide; /* Nuclides in order of appearance, moved to general->nuclide by events_end() */
+    int nalloc;
+    int n; /* Number of events added */
+} EventSink;
+
+void read_command_line(int, char **, General *);
+void read_setup(General *, Measurement *, Concentration *);
+void print_settings(General *);
+void events_init(General *, Events *);
+void read_events(General *, Measurement *, Events *);
+void events_begin(EventSink *, General *, Measurement *, Events *);
+int events_add(EventSink *, double, double, double, int, double, int, double, int);
+int events_add_depth(EventSink *, int, double, double, double, int);
+void events_end(EventSink *);
+void analyze_events(General *, Measurement *, Events *, Stopping *, Concentration *);
+void solve_depths(General *, Measurement *, Events *, Stopping *, Concentration *);
+void sweep(General *, Measurement *, Events *, Stopping *, Concentration *);
+void save_depths(General *, Concentration *, Events *);
+void read_depths(General *, Measurement *, Events *, Concentration *);
+void events_grow(Events *, int);
+void events_spill(General *, Events *, int);
+void events_map(Events *, int);
+void events_free(Events *);
+void reset_events(General *, Measurement *, Events *, Concentration *);
+void calculate_depths(General *, Measurement *, Events *, Stopping *, Concentration *);
+char *read_inputline(char *, int);
+int read_list(const char *, double *, int, double);
+void file_error(char *, int);
+double ipow(double, int);
+void calculate_stoppings(General *, Measurement *, Stopping *);
+double stopping_ele(General *, int, int, double);
+void create_sumsto(General *, Stopping *, Concentration *);
+void depth_grid_uniform(DepthGrid *, int, double);
+void depth_grid_make_index(DepthGrid *);
+int depth_grid_step(const DepthGrid *, double);
+void refine_depth_grid(General *, Stopping *, Concentration *, int);
+void create_conc_profile(General *, Measurement *, Stopping *,
+                         Concentration *);
+void calculate_primary_energy(General *, Measurement *, Stopping *,
+                              Concentration *);
+double get_eloss(General *, int, double, double, double, double, Stopping *);
+double get_eloss_trapezoid(General *, int, double, double, double, double, Stopping *);
+double get_eloss_rk23(General *, int, double, double, double, double, Stopping *);
+double inter_sto(General *, int, double, double, Stopping *);
+void calculate_recoil_depths(General *, Measurement *, Events *,
+                             Stopping *, Concentration *);
+int recoil_depth(General *, Measurement *, Stopping *, Concentration *, int, int, double, double, double, double,
+                 double *, double *);
+void histogram_fill(Histogram *, const Events *, int, int, const int *);
+void histogram_fill_multi(Histogram *, int, const Events *, int, int, const int *);
+void order_events_by_cost(General *, Events *, const DepthGrid *);
+void order_events_by_locality(General *, Events *);
+void output(General *, Concentration *, Events *, double *);
+void output_profiles(General *, Concentration *, Histogram *, double, const char *, double *);
+void clear_conc(General *, Concentration *);
+int nuclide_add(Nuclide **, int *, int *, int, int, double);
+void nuclide_index(General *, Events *);
+char *get_symbol(int);
+double Lecuyer(int, int, double);
+double Andersen(int, int, double, double);
+double Serd(int, double, int, double, double, double, enum cross_section);
+double Srbs(int, double, int, double, double, double, enum cross_section);
+double Srbs_mc(double, double, double, double);
+double mc2lab_scatc(double, double, double);
+int allocate_general_sto_conc(General *, Measurement *, Stopping *, Concentration *);
+void *table_alloc(General *, size_t, size_t);
+
+/* Access to events regardless of how they are stored */
+
+static inline double event_theta(const Events *events, int i) {
+    return events->compact ? events->cevent[i].theta : events->event[i].theta;
+}
+
+static inline double event_E(const Events *events, int i) {
+    return events->compact ? events->cevent[i].E : events->event[i].E;
+}
+
+static inline double event_M(const Events *events, int i) {
+    return events->compact ? events->nuclide[events->cevent[i].nuc].M : events->event[i].M;
+}
+
+static inline double event_w0(const Events *events, int i) {
+    return events->compact ? events->cevent[i].w0 : events->event[i].w0;
+}
+
+static inline double event_w(const Events *events, int i) {
+    return events->compact ? events->cevent[i].w : events->event[i].w;
+}
+
+static inline double event_d(const Events *events, int i) {
+    return events->compact ? events->cevent[i].d : events->event[i].d;
+}
+
+static inline int event_type(const Events *events, int i) {
+    return events->compact ? events->cevent[i].type : events->event[i].type;
+}
+
+static inline int event_Z(const Events *events, int i) {
+    return events->compact ? events->cevent[i].Z : events->event[i].Z;
+}
+
+static inline int event_nuc(const Events *events, int i) {
+    return events->compact ? events->cevent[i].nuc : events->event[i].nuc;
+}
+
+static inline int event_cost(const Events *events, const DepthGrid *grid, int i) {
+    /* Compact events don't store the number of depth steps taken, it is estimated from the depth */
+    if (!events->compact)
+        return events->event[i].cost;
+    if (!(events->cevent[i].w > 0.0))
+        return grid->n;
+    if (events->cevent[i].d <= 0.0)
+        return 0;
+    return depth_grid_step(grid, events->cevent[i].d) + 1;
+}
+
+static inline void event_set(Events *events, int i, double d, double w, int cost) {
+    if (events->compact) {
+        events->cevent[i].d = (float) d;
+        events->cevent[i].w = (float) w;
+    } else {
+        events->event[i].d = d;
+        events->event[i].w = w;
+        events->event[i].cost = cost;
+    }
+}
+#endif // ERD_DEPTH_H
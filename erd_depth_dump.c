@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiles.h"
+
+/* Writes the text output of erd_depth from a binary profile file. */
+
+int main(int argc, char *argv[]) {
+    Profiles *prof;
+    char *prefix;
+    size_t len, extlen = strlen(PROFILES_EXTENSION);
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: erd_depth_dump <profile file> [output prefix]\n");
+        fprintf(stderr, "Default output prefix is the profile file without extension %s\n", PROFILES_EXTENSION);
+        exit(1);
+    }
+    prof = profiles_read_binary(argv[1]);
+    if (prof == NULL)
+        exit(2);
+    if (argc > 2) {
+        prefix = strdup(argv[2]);
+    } else {
+        prefix = strdup(argv[1]);
+        len = strlen(prefix);
+        if (len > extlen && !strcmp(prefix + len - extlen, PROFILES_EXTENSION))
+            prefix[len - extlen] = '\0';
+    }
+    fprintf(stderr, "%i nuclides, %i depth bins of %g 1e15 at./cm2, density %g g/cm3\n",
+            prof->nnuclides, prof->nbins, prof->outstep, prof->density);
+    for (i = 0; i < prof->nnuclides; i++)
+        fprintf(stderr, "%-6s Z = %3i, A = %3i, M = %8.4f u\n", prof->nuclide[i].name, prof->nuclide[i].Z,
+                prof->nuclide[i].A, prof->nuclide[i].M);
+    if (profiles_write_text(prof, prefix))
+        exit(6);
+    free(prefix);
+    profiles_free(prof);
+    exit(0);
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <jibal.h>
+
+#include "erd_depth.h"
+
+int main(int argc, char *argv[]) {
+    General general;
+    Stopping sto;
+    Concentration conc;
+    Events events;
+    Measurement meas;
+    int i;
+    for (i = 0; i < argc; i++) {
+        fprintf(stderr, "%s%s", argv[i], i < argc - 1 ? " " : "\n");
+    }
+    general.jibal = jibal_init(NULL);
+    if (general.jibal->error) {
+        fprintf(stderr, "Initializing JIBAL failed with error code: %i (%s)\n", general.jibal->error,
+                jibal_error_string(general.jibal->error));
+        return EXIT_FAILURE;
+    }
+    read_command_line(argc, argv, &general);
+    read_setup(&general, &meas, &conc);
+    allocate_general_sto_conc(&general, &meas, &sto, &conc);
+    print_settings(&general);
+    events_init(&general, &events);
+    if (general.rebin) {
+        read_depths(&general, &meas, &events, &conc);
+        output(&general, &conc, &events, NULL);
+    } else if (general.sweep.active) {
+        read_events(&general, &meas, &events);
+        sweep(&general, &meas, &events, &sto, &conc);
+    } else {
+        read_events(&general, &meas, &events);
+        analyze_events(&general, &meas, &events, &sto, &conc);
+        output(&general, &conc, &events, NULL);
+    }
+    arena_free(general.arena);
+    events_free(&events);
+    jibal_free(general.jibal);
+    exit(0);
+}
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <jibal.h>
+#include <jibal_gsto.h>
+#include "erd_depth_config.h"
+#include "erd_depth.h"
+#include "message.h"
+#include "tof_in.h"
+#include "tofe_list.h"
+
+/* Runs tofe_list and erd_depth in one process. Converted events are added to the event store of erd_depth directly,
+ * without formatting them as text. The same tof.in is the settings file of tofe_list and the setup file of erd_depth,
+ * which reads the keys it knows and ignores the rest.
+ *
+ * Results are not identical to running tofe_list and erd_depth on its text output: the text format rounds energies,
+ * angles, masses and weights to a few decimals, here events keep full double precision. Differences are at the level
+ * of that rounding. */
+
+static int pipeline_events(void *data, const cutfile *cutfile, const tofe_event *event, size_t n) {
+    EventSink *sink = data;
+    for(size_t i = 0; i < n; i++) {
+        const tofe_event *ev = &event[i];
+        if(!events_add(sink, ev->angle1, ev->angle2, ev->energy, ev->Z, ev->mass, ev->type == SCATTER_RBS ? RBS : ERD, ev->weight, ev->evnum)) {
+            tofe_list_msg(TOFE_LIST_ERROR, "Too many events, stopped at event %zu of file \"%s\".", i, cutfile->basename);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    General general;
+    Stopping sto;
+    Concentration conc;
+    Events events;
+    Measurement meas;
+    EventSink sink;
+    tofe_list_msg(TOFE_LIST_INFO, "erd_pipeline (erd_depth) version %s", ERD_DEPTH_VERSION);
+    if(argc < 4) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Not enough arguments. Usage: erd_pipeline <output prefix> <tof.in file> <cutfile1> <cutfile2> ...\n"
+                      "Events are not rounded like in the text output of tofe_list, so results differ slightly from erd_depth.");
+        return EXIT_FAILURE;
+    }
+    if(strlen(argv[1]) >= NAMELEN || strlen(argv[2]) >= NAMELEN) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Output prefix or tof.in filename is too long.");
+        return EXIT_FAILURE;
+    }
+    jibal *jibal = jibal_init(NULL);
+    if(!jibal || jibal->error) {
+        tofe_list_msg(TOFE_LIST_ERROR, "JIBAL initialization by erd_pipeline failed.");
+        return EXIT_FAILURE;
+    }
+    general.jibal = jibal;
+    strcpy(general.prefix, argv[1]);
+    strcpy(general.setupfile, argv[2]);
+    strcpy(general.eventfile, "");
+    read_setup(&general, &meas, &conc);
+    allocate_general_sto_conc(&general, &meas, &sto, &conc);
+    print_settings(&general);
+    events_init(&general, &events);
+
+    tofin_file *tofin = tofin_file_load(argv[2]);
+    if(!tofin) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Could not load or parse settings file \"%s\".", argv[2]);
+        return EXIT_FAILURE;
+    }
+    list_files *files = tofe_files_from_argv(jibal, tofin, argc - 3, argv + 3);
+    if(!files) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Error in reading cutfiles.");
+        return EXIT_FAILURE;
+    }
+    tofe_files_print(files);
+    jibal_material *foil = tofe_files_stopping(jibal, tofin, files);
+    if(!foil) {
+        return EXIT_FAILURE;
+    }
+    tofe_list_msg(TOFE_LIST_INFO, "Starting conversion of %zu cutfiles.", files->n_files);
+    events_begin(&sink, &general, &meas, &events);
+    tofe_sink to_erd_depth = {pipeline_events, &sink};
+    if(tofe_files_convert(jibal, tofin, files, foil, &to_erd_depth)) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Conversion of cutfiles failed.");
+        return EXIT_FAILURE;
+    }
+    events_end(&sink);
+    jibal_material_free(foil);
+    tofe_files_free(files);
+    tofin_file_free(tofin);
+
+    if(general.sweep.active) {
+        sweep(&general, &meas, &events, &sto, &conc);
+    } else {
+        analyze_events(&general, &meas, &events, &sto, &conc);
+        output(&general, &conc, &events, NULL);
+    }
+    arena_free(general.arena);
+    events_free(&events);
+    jibal_free(jibal);
+    return EXIT_SUCCESS;
+}
@@ -2,6 +2,8 @@
 #include <stdarg.h>
 #include "message.h"
 
+static FILE *msg_summary_file = NULL;
+
 const char *msg_level_str(tofe_list_msg_level level) {
     switch(level) {
         case TOFE_LIST_NORMAL:
@@ -20,8 +22,74 @@ const char *msg_level_str(tofe_list_msg_level level) {
 void tofe_list_msg(tofe_list_msg_level level, const char *restrict format, ...) {
     va_list ap;
     va_start(ap, format);
-    fprintf(stderr, "tofe_list %s: ", msg_level_str(level));
-    vfprintf(stderr, format, ap);
-    fputc('\n', stderr);
+#pragma omp critical (tofe_list_msg)
+    { /* Messages from different threads are not mixed */
+        fprintf(stderr, "tofe_list %s: ", msg_level_str(level));
+        vfprintf(stderr, format, ap);
+        fputc('\n', stderr);
+    }
+    va_end(ap);
+}
+
+void tofe_list_msg_site_init(tofe_list_msg_site *site, const char *name, const char *description, const char *unit, tofe_list_msg_level level, size_t limit) {
+    site->name = name;
+    site->description = description;
+    site->unit = unit;
+    site->level = level;
+    site->limit = limit;
+    site->count = 0;
+    site->min = 0.0;
+    site->max = 0.0;
+}
+
+void tofe_list_msg_limited(tofe_list_msg_site *site, double value, const char *restrict format, ...) {
+    /* Counts an occurrence of a message and prints the message if it is one of the first ones. Value (e.g. energy of
+     * the event) is included in the range reported by tofe_list_msg_summary(). */
+    va_list ap;
+    size_t count;
+#pragma omp critical (tofe_list_msg_site)
+    {
+        count = ++site->count;
+        if(count == 1 || value < site->min) {
+            site->min = value;
+        }
+        if(count == 1 || value > site->max) {
+            site->max = value;
+        }
+    }
+    if(count > site->limit) {
+        return;
+    }
+    va_start(ap, format);
+#pragma omp critical (tofe_list_msg)
+    {
+        fprintf(stderr, "tofe_list %s: ", msg_level_str(site->level));
+        vfprintf(stderr, format, ap);
+        if(count == site->limit) {
+            fprintf(stderr, " (limit of %zu messages reached, the rest are summarized)", site->limit);
+        }
+        fputc('\n', stderr);
+    }
     va_end(ap);
 }
+
+void tofe_list_msg_summary(const tofe_list_msg_site *site, const char *context) {
+    /* Prints how many times the message occurred and range of values. Nothing is printed if it never occurred. A
+     * tab separated line (context, name, count, min, max) is also written to the summary file, if one is set. */
+    if(site->count == 0) {
+        return;
+    }
+#pragma omp critical (tofe_list_msg)
+    {
+        fprintf(stderr, "tofe_list %s: %s: %s %zu times (%zu shown), values %g - %g %s\n", msg_level_str(site->level),
+                context, site->description, site->count, site->count < site->limit ? site->count : site->limit,
+                site->min, site->max, site->unit);
+        if(msg_summary_file) {
+            fprintf(msg_summary_file, "%s\t%s\t%zu\t%g\t%g\n", context, site->name, site->count, site->min, site->max);
+        }
+    }
+}
+
+void tofe_list_msg_summary_file(FILE *f) { /* Machine readable summaries are written to f (NULL to disable) */
+    msg_summary_file = f;
+}
@@ -1,5 +1,8 @@
 #ifndef TOFELIST_MESSAGE_H
 #define TOFELIST_MESSAGE_H
+#include <stdio.h>
+
+#define TOFE_LIST_MSG_LIMIT (10) /* Repeated messages (e.g. warnings about single events) printed per site */
 
 typedef enum tofe_list_msg_level {
     TOFE_LIST_NORMAL = 0,
@@ -8,6 +11,20 @@ typedef enum tofe_list_msg_level {
     TOFE_LIST_ERROR = 3
 } tofe_list_msg_level;
 
+typedef struct tofe_list_msg_site { /* Counts occurrences of a repeated message, e.g. a warning about events of one file */
+    const char *name; /* Machine readable identifier */
+    const char *description; /* For the summary, e.g. "efficiency too low" */
+    const char *unit; /* Unit of values */
+    tofe_list_msg_level level;
+    size_t limit; /* This many first occurrences are printed */
+    size_t count;
+    double min, max; /* Range of values given with occurrences */
+} tofe_list_msg_site;
+
 const char *msg_level_str(tofe_list_msg_level level);
 void tofe_list_msg(tofe_list_msg_level level, const char *restrict format, ...);
+void tofe_list_msg_site_init(tofe_list_msg_site *site, const char *name, const char *description, const char *unit, tofe_list_msg_level level, size_t limit);
+void tofe_list_msg_limited(tofe_list_msg_site *site, double value, const char *restrict format, ...);
+void tofe_list_msg_summary(const tofe_list_msg_site *site, const char *context);
+void tofe_list_msg_summary_file(FILE *f);
 #endif // TOFELIST_MESSAGE_H
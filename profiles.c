@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "profiles.h"
+
+typedef struct {
+    const char *name;
+    const char *unit;
+    enum profiles_type type;
+    int nuclide;
+    void *data;
+} ProfileColumn;
+
+Profiles *profiles_alloc(int nnuclides, int nbins) {
+    Profiles *p = calloc(1, sizeof(Profiles));
+    if(!p)
+        return NULL;
+    p->nnuclides = nnuclides;
+    p->nbins = nbins;
+    p->nuclide = calloc(nnuclides ? nnuclides : 1, sizeof(ProfileNuclide));
+    p->depth = calloc(nbins, sizeof(double));
+    p->mdepth = calloc(nbins, sizeof(double));
+    p->ldepth = calloc(nbins, sizeof(double));
+    p->conc = calloc((size_t) (nnuclides + 1) * nbins, sizeof(double));
+    p->w = calloc((size_t) nnuclides * nbins + 1, sizeof(double));
+    p->err = calloc((size_t) nnuclides * nbins + 1, sizeof(double));
+    p->n = calloc((size_t) nnuclides * nbins + 1, sizeof(int));
+    if(!p->nuclide || !p->depth || !p->mdepth || !p->ldepth || !p->conc || !p->w || !p->err || !p->n) {
+        profiles_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+void profiles_free(Profiles *p) {
+    if(!p)
+        return;
+    free(p->nuclide);
+    free(p->depth);
+    free(p->mdepth);
+    free(p->ldepth);
+    free(p->conc);
+    free(p->w);
+    free(p->err);
+    free(p->n);
+    free(p);
+}
+
+static int profiles_columns(const Profiles *p, ProfileColumn *col) {
+    /* Fills col (if not NULL) with the columns of the binary file, returns the number of columns */
+    int n = 0, inuc;
+    ProfileColumn axes[] = {
+            {"depth",      "1e15 at./cm2", PROFILES_DOUBLE, -1, p->depth},
+            {"mass_depth", "ug/cm2",       PROFILES_DOUBLE, -1, p->mdepth},
+            {"depth_nm",   "nm",           PROFILES_DOUBLE, -1, p->ldepth}
+    };
+    for(n = 0; n < (int) (sizeof(axes) / sizeof(axes[0])); n++) {
+        if(col)
+            col[n] = axes[n];
+    }
+    for(inuc = 0; inuc < p->nnuclides; inuc++) {
+        ProfileColumn nuc[] = {
+                {"concentration", "", PROFILES_DOUBLE, inuc, p->conc + inuc * p->nbins},
+                {"weight",        "", PROFILES_DOUBLE, inuc, p->w + inuc * p->nbins},
+                {"error",         "", PROFILES_DOUBLE, inuc, p->err + inuc * p->nbins},
+                {"counts",        "", PROFILES_INT,    inuc, p->n + inuc * p->nbins}
+        };
+        for(int i = 0; i < (int) (sizeof(nuc) / sizeof(nuc[0])); i++, n++) {
+            if(col)
+                col[n] = nuc[i];
+        }
+    }
+    if(col)
+        col[n] = (ProfileColumn) {"concentration", "", PROFILES_DOUBLE, p->nnuclides, p->conc + p->nnuclides * p->nbins};
+    n++;
+    return n;
+}
+
+static size_t profiles_type_size(enum profiles_type type) { /* int is assumed to be 32 bits */
+    return type == PROFILES_INT ? sizeof(int32_t) : sizeof(double);
+}
+
+static void profiles_name(char *dst, const char *src) { /* Fixed length, zero padded name for the file */
+    size_t len = strlen(src);
+    if(len > PROFILES_NAMELEN - 1)
+        len = PROFILES_NAMELEN - 1;
+    memset(dst, 0, PROFILES_NAMELEN);
+    memcpy(dst, src, len);
+}
+
+int profiles_write_text(const Profiles *p, const char *prefix) {
+    /* Writes the traditional output: one file for each nuclide and the total */
+    FILE *fp;
+    char *fname = malloc(strlen(prefix) + PROFILES_NAMELEN + 2);
+    int inuc, ip;
+
+    if(!fname)
+        return -1;
+    for(inuc = 0; inuc < p->nnuclides; inuc++) {
+        const double *conc = p->conc + inuc * p->nbins;
+        const double *w = p->w + inuc * p->nbins;
+        const double *err = p->err + inuc * p->nbins;
+        const int *n = p->n + inuc * p->nbins;
+        sprintf(fname, "%s.%s", prefix, p->nuclide[inuc].name);
+        fp = fopen(fname, "w");
+        fprintf(stderr, "Writing output to file %s\n", fname);
+        if(fp == NULL) {
+            fprintf(stderr, "Could not open file %s\n for writing", fname);
+            free(fname);
+            return -1;
+        }
+        for(ip = 0; ip < p->nbins; ip++) {
+            fprintf(fp, "%10.3f %10.3f %10.3f ", p->depth[ip], p->mdepth[ip], p->ldepth[ip]);
+            fprintf(fp, "  %10.5f", conc[ip]);
+            fprintf(fp, "  %14.5e", w[ip]);
+            fprintf(fp, "  %10.5f", err[ip]);
+            fprintf(fp, "  %10i", n[ip]);
+            fprintf(fp, "\n");
+        }
+        fclose(fp);
+    }
+
+    sprintf(fname, "%s.total", prefix);
+    fp = fopen(fname, "w");
+    if(fp == NULL) {
+        fprintf(stderr, "Could not open file %s\n for writing", fname);
+        free(fname);
+        return -1;
+    }
+    for(ip = 0; ip < p->nbins; ip++) {
+        fprintf(fp, "%7.2f %10.3f %10.3f ", p->depth[ip], p->mdepth[ip], p->ldepth[ip]);
+        fprintf(fp, "%10.4e\n", p->conc[p->nnuclides * p->nbins + ip]);
+    }
+    fclose(fp);
+    free(fname);
+    return 0;
+}
+
+int profiles_write_binary(const Profiles *p, const char *filename) {
+    FILE *fp;
+    ProfileColumn *col;
+    int32_t head[4] = {PROFILES_BYTE_ORDER, p->nnuclides, p->nbins, 0};
+    double scalars[3] = {p->outstep, p->density, p->wsum};
+    char name[PROFILES_NAMELEN];
+    int i, error = 0;
+
+    head[3] = profiles_columns(p, NULL);
+    col = malloc(head[3] * sizeof(ProfileColumn));
+    if(!col)
+        return -1;
+    profiles_columns(p, col);
+    fp = fopen(filename, "wb");
+    if(fp == NULL) {
+        fprintf(stderr, "Could not open file %s for writing\n", filename);
+        free(col);
+        return -1;
+    }
+    fprintf(stderr, "Writing binary output to file %s\n", filename);
+    fwrite(PROFILES_MAGIC, 1, PROFILES_MAGIC_LEN, fp);
+    fwrite(head, sizeof(int32_t), 4, fp);
+    fwrite(scalars, sizeof(double), 3, fp);
+    for(i = 0; i < p->nnuclides; i++) {
+        int32_t za[2] = {p->nuclide[i].Z, p->nuclide[i].A};
+        fwrite(za, sizeof(int32_t), 2, fp);
+        fwrite(&p->nuclide[i].M, sizeof(double), 1, fp);
+        profiles_name(name, p->nuclide[i].name);
+        fwrite(name, 1, PROFILES_NAMELEN, fp);
+    }
+    for(i = 0; i < head[3]; i++) {
+        int32_t tn[2] = {col[i].type, col[i].nuclide};
+        profiles_name(name, col[i].name);
+        fwrite(name, 1, PROFILES_NAMELEN, fp);
+        profiles_name(name, col[i].unit);
+        fwrite(name, 1, PROFILES_NAMELEN, fp);
+        fwrite(tn, sizeof(int32_t), 2, fp);
+    }
+    for(i = 0; i < head[3]; i++) {
+        fwrite(col[i].data, profiles_type_size(col[i].type), p->nbins, fp);
+    }
+    if(ferror(fp))
+        error = -1;
+    if(fclose(fp))
+        error = -1;
+    if(error)
+        fprintf(stderr, "Error in writing file %s\n", filename);
+    free(col);
+    return error;
+}
+
+static int profiles_read(FILE *fp, void *data, size_t size, size_t n) {
+    return fread(data, size, n, fp) == n ? 0 : -1;
+}
+
+Profiles *profiles_read_binary(const char *filename) {
+    /* Columns are matched by name and nuclide, unknown columns are skipped */
+    FILE *fp;
+    Profiles *p = NULL;
+    ProfileColumn *col = NULL;
+    void **dest = NULL; /* Where each column of the file is read, NULL if the column is skipped */
+    int32_t *type = NULL;
+    char magic[PROFILES_MAGIC_LEN], name[PROFILES_NAMELEN], unit[PROFILES_NAMELEN];
+    int32_t head[4], za[2], tn[2];
+    double scalars[3];
+    int i, j, ncol, error = 0;
+
+    fp = fopen(filename, "rb");
+    if(fp == NULL) {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        return NULL;
+    }
+    if(profiles_read(fp, magic, 1, PROFILES_MAGIC_LEN) || memcmp(magic, PROFILES_MAGIC, PROFILES_MAGIC_LEN)) {
+        fprintf(stderr, "File %s is not a binary profile file\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    if(profiles_read(fp, head, sizeof(int32_t), 4) || head[0] != PROFILES_BYTE_ORDER ||
+       head[1] < 0 || head[2] < 0 || head[3] < 0 || profiles_read(fp, scalars, sizeof(double), 3)) {
+        fprintf(stderr, "Invalid header (or byte order) in file %s\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    p = profiles_alloc(head[1], head[2]);
+    if(!p) {
+        fclose(fp);
+        return NULL;
+    }
+    p->outstep = scalars[0];
+    p->density = scalars[1];
+    p->wsum = scalars[2];
+    for(i = 0; i < p->nnuclides && !error; i++) {
+        error = profiles_read(fp, za, sizeof(int32_t), 2) || profiles_read(fp, &p->nuclide[i].M, sizeof(double), 1) ||
+                profiles_read(fp, p->nuclide[i].name, 1, PROFILES_NAMELEN);
+        p->nuclide[i].Z = za[0];
+        p->nuclide[i].A = za[1];
+        p->nuclide[i].name[PROFILES_NAMELEN - 1] = '\0';
+    }
+    ncol = profiles_columns(p, NULL);
+    col = malloc(ncol * sizeof(ProfileColumn));
+    if(col)
+        profiles_columns(p, col);
+    else
+        error = 1;
+    dest = calloc(head[3] + 1, sizeof(void *));
+    type = calloc(head[3] + 1, sizeof(int32_t));
+    if(!dest || !type)
+        error = 1;
+    for(i = 0; i < head[3] && !error; i++) {
+        error = profiles_read(fp, name, 1, PROFILES_NAMELEN) || profiles_read(fp, unit, 1, PROFILES_NAMELEN) ||
+                profiles_read(fp, tn, sizeof(int32_t), 2);
+        name[PROFILES_NAMELEN - 1] = '\0';
+        type[i] = tn[0];
+        for(j = 0; j < ncol; j++) {
+            if(!strcmp(name, col[j].name) && tn[1] == col[j].nuclide && tn[0] == (int32_t) col[j].type)
+                dest[i] = col[j].data;
+        }
+    }
+    for(i = 0; i < head[3] && !error; i++) {
+        size_t size = profiles_type_size(type[i]);
+        if(!dest[i]) {
+            error = fseek(fp, (long) (size * p->nbins), SEEK_CUR) != 0;
+        } else {
+            error = profiles_read(fp, dest[i], size, p->nbins);
+        }
+    }
+    fclose(fp);
+    free(dest);
+    free(type);
+    free(col);
+    if(error) {
+        fprintf(stderr, "Error in reading file %s\n", filename);
+        profiles_free(p);
+        return NULL;
+    }
+    return p;
+}
@@ -0,0 +1,57 @@
+#ifndef ERD_DEPTH_PROFILES_H
+#define ERD_DEPTH_PROFILES_H
+
+#include <stdint.h>
+
+#define PROFILES_MAGIC "ERDPROF1" /* First bytes of a binary profile file */
+#define PROFILES_MAGIC_LEN (8)
+#define PROFILES_BYTE_ORDER (0x01020304) /* Written as native uint32, files can only be read with the same byte order */
+#define PROFILES_NAMELEN (16) /* Length of nuclide names, column names and units in the file, including '\0' */
+#define PROFILES_EXTENSION ".prof"
+
+/* Binary profile file, all integers are 32 bit and all numbers are in native byte order:
+ *
+ * magic[8], byte order, nnuclides, nbins, ncolumns
+ * outstep (1e15 at./cm2), density (g/cm3), wsum (double)
+ * nnuclides times: Z, A, M (u, double), name[16]
+ * ncolumns times: name[16], unit[16], type (PROFILES_DOUBLE or PROFILES_INT), nuclide (-1 for depth axes, nnuclides
+ *                 for the total)
+ * ncolumns times: nbins values of the column
+ *
+ * The depth axes are written once, then concentration, weight, error and counts of each nuclide and finally the total
+ * concentration. */
+
+enum profiles_type {
+    PROFILES_DOUBLE = 0,
+    PROFILES_INT = 1
+};
+
+typedef struct {
+    int Z;
+    int A;
+    double M; /* in u */
+    char name[PROFILES_NAMELEN]; /* Suffix of the text output file, e.g. "H" or "16O" */
+} ProfileNuclide;
+
+typedef struct {
+    int nnuclides;
+    int nbins;
+    double outstep; /* in 1e15 at./cm2 */
+    double density; /* in g/cm3 */
+    double wsum; /* Weight corresponding to concentration of one */
+    ProfileNuclide *nuclide; /* nuclide[0..nnuclides] */
+    double *depth; /* depth[0..nbins], middle of bin in 1e15 at./cm2 */
+    double *mdepth; /* mdepth[0..nbins], start of bin in ug/cm2 */
+    double *ldepth; /* ldepth[0..nbins], start of bin in nm */
+    double *conc; /* conc[0..(nnuclides + 1)*nbins], one row for each nuclide, the last row is the total */
+    double *w; /* w[0..nnuclides*nbins], sum of event weights */
+    double *err; /* err[0..nnuclides*nbins], statistical error of concentration */
+    int *n; /* n[0..nnuclides*nbins], number of events */
+} Profiles;
+
+Profiles *profiles_alloc(int nnuclides, int nbins);
+void profiles_free(Profiles *p);
+int profiles_write_text(const Profiles *p, const char *prefix);
+int profiles_write_binary(const Profiles *p, const char *filename);
+Profiles *profiles_read_binary(const char *filename);
+#endif // ERD_DEPTH_PROFILES_H
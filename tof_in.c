@@ -15,6 +15,11 @@ int tofin_file_parse_header(tofin_file *tofin, const char *header, const char *d
         case TOFIN_HEADER_BEAM:
             break;
         case TOFIN_HEADER_ENERGY:
+            tofin->beam_energy = strtod(data, &end) * C_MEV;
+            if(end == data) {
+                tofe_list_msg(TOFE_LIST_ERROR, "Beam energy could not be parsed.");
+                return -1;
+            }
             break;
         case TOFIN_HEADER_DETECTOR_ANGLE:
             break;
@@ -64,6 +69,15 @@ int tofin_file_parse_header(tofin_file *tofin, const char *header, const char *d
             free(tofin->efficiency_directory);
             tofin->efficiency_directory = strdup(data);
             break;
+        case TOFIN_HEADER_RANDOM_SEED:
+            tofin->random_seed = strtoull(data, &end, 10);
+            if(end == data) {
+                tofe_list_msg(TOFE_LIST_ERROR, "Random seed could not be parsed.");
+                return -1;
+            }
+            break;
+        case TOFIN_HEADER_ERD_DEPTH:
+            break;
         case TOFIN_HEADER_NONE:
         default:
             tofe_list_msg(TOFE_LIST_WARNING, "Unknown header \"%s\"", header);
@@ -1,10 +1,12 @@
 #ifndef TOF_IN_H
 #define TOF_IN_H
 
+#include <stdint.h>
 #include <jibal_option.h>
 #define CARBON_DENSITY
 
 typedef struct tofin_file {
+    double beam_energy; /* zero if not given */
     double toflen;
     double foil_thickness; /* initially in ug/cm2, then in tfu */
     double tof_slope;
@@ -12,6 +14,7 @@ typedef struct tofin_file {
     double angle_slope;
     double angle_offset;
     char *efficiency_directory;
+    uint64_t random_seed; /* Seed of ToF channel dithering */
 } tofin_file;
 
 typedef enum {
@@ -31,7 +34,9 @@ typedef enum {
     TOFIN_HEADER_DEPTHS_CONCENTRATION_SCALING = 13,
     TOFIN_HEADER_CROSS_SECTION = 14,
     TOFIN_HEADER_ITERATIONS = 15,
-    TOFIN_HEADER_EFFICIENCY_DIRECTORY = 16
+    TOFIN_HEADER_EFFICIENCY_DIRECTORY = 16,
+    TOFIN_HEADER_RANDOM_SEED = 17,
+    TOFIN_HEADER_ERD_DEPTH = 18 /* Settings of erd_depth only, tof.in is also its setup file in erd_pipeline */
 } tofin_header_type;
 
 static const jibal_option tofin_headers[] = {
@@ -52,6 +57,21 @@ static const jibal_option tofin_headers[] = {
         {"Cross section",                    TOFIN_HEADER_CROSS_SECTION},
         {"Number of iterations",             TOFIN_HEADER_ITERATIONS},
         {"Efficiency directory",             TOFIN_HEADER_EFFICIENCY_DIRECTORY},
+        {"Random seed",                      TOFIN_HEADER_RANDOM_SEED},
+        {"Event ordering",                   TOFIN_HEADER_ERD_DEPTH},
+        {"Energy loss integrator",           TOFIN_HEADER_ERD_DEPTH},
+        {"Energy loss tolerance",            TOFIN_HEADER_ERD_DEPTH},
+        {"Depth grid",                       TOFIN_HEADER_ERD_DEPTH},
+        {"Stopping interpolation tolerance", TOFIN_HEADER_ERD_DEPTH},
+        {"Single precision",                 TOFIN_HEADER_ERD_DEPTH},
+        {"Compact events",                   TOFIN_HEADER_ERD_DEPTH},
+        {"Memory limit",                     TOFIN_HEADER_ERD_DEPTH},
+        {"Output format",                    TOFIN_HEADER_ERD_DEPTH},
+        {"Save event depths",                TOFIN_HEADER_ERD_DEPTH},
+        {"Sweep target density",             TOFIN_HEADER_ERD_DEPTH},
+        {"Sweep target angle",               TOFIN_HEADER_ERD_DEPTH},
+        {"Sweep detector angle offset",      TOFIN_HEADER_ERD_DEPTH},
+        {"Sweep cross section",              TOFIN_HEADER_ERD_DEPTH},
         {0,                                  0}
 };
 
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <jibal.h>
+#include "tof_in.h"
+#include "tofe_list.h"
+
+/* Compares tofe_buffer_event_line() byte by byte to snprintf() output of the same format on randomised lines. The
+ * random numbers are from a fixed seed, so failures are reproducible. Usage: tofe_event_line_test [number of lines] */
+
+#define EVENT_LINE_FORMAT "%8.5lf %8.5lf %8.5lf %3i %8.4lf %3s %8.5lf %8i\n"
+
+static uint64_t test_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t test_rand(void) { /* xorshift64* */
+    test_state ^= test_state >> 12;
+    test_state ^= test_state << 25;
+    test_state ^= test_state >> 27;
+    return test_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double test_uniform(double min, double max) {
+    return min + (max - min) * (double) (test_rand() >> 11) / 9007199254740992.0; /* 2^53 */
+}
+
+static double test_double(int prec) {
+    /* Values the formatter has to get right: ordinary numbers, exact and nearly exact rounding ties in the last
+     * printed digit, numbers rounding to (negative) zero, huge numbers and bit patterns, which include NaN and inf. */
+    static const double scale[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5};
+    double x, tie;
+    uint64_t bits;
+    switch(test_rand() % 8) {
+        case 0:
+            return test_uniform(-100.0, 100.0);
+        case 1:
+            return test_uniform(-1.0e7, 1.0e7);
+        case 2:
+            return test_uniform(-1.0, 1.0) * pow(10.0, -(double) (test_rand() % 12));
+        case 3:
+        case 4:
+            tie = ((double) (test_rand() % 20000000) - 10000000.0 + 0.5) / scale[prec];
+            x = tie;
+            for(int i = (int) (test_rand() % 7) - 3; i != 0; i += (i < 0 ? 1 : -1)) { /* Up to 3 ulps away */
+                x = nextafter(x, i < 0 ? -INFINITY : INFINITY);
+            }
+            return x;
+        case 5: {
+            static const double special[] = {0.0, -0.0, 0.5, -0.5, 999999.99999, 1.0e6, -1.0e6, 1.0e300, -1.0e-300,
+                                             INFINITY, -INFINITY, NAN};
+            return special[test_rand() % (sizeof(special) / sizeof(special[0]))];
+        }
+        default:
+            bits = test_rand();
+            memcpy(&x, &bits, sizeof(x));
+            return x;
+    }
+}
+
+static int test_int(void) {
+    switch(test_rand() % 4) {
+        case 0:
+            return (int) (test_rand() % 120);
+        case 1:
+            return (int) (test_rand() % 2000000) - 1000000;
+        case 2:
+            return (test_rand() & 1) ? INT_MIN : INT_MAX;
+        default:
+            return (int) (uint32_t) test_rand();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const char *types[] = {"ERD", "RBS", "", "X", "ERD_LONG_TYPE"};
+    tofe_buffer buf = {NULL, 0, 0};
+    char expected[4096]; /* Five numbers of up to ~310 characters */
+    long i, n = argc > 1 ? atol(argv[1]) : 200000, failures = 0;
+
+    for(i = 0; i < n; i++) {
+        double angle1 = test_double(5), angle2 = test_double(5), energy = test_double(5);
+        double mass = test_double(4), weight = test_double(5);
+        int Z = test_int(), evnum = test_int();
+        const char *type_str = types[test_rand() % (sizeof(types) / sizeof(types[0]))];
+        int len = snprintf(expected, sizeof(expected), EVENT_LINE_FORMAT, angle1, angle2, energy, Z, mass, type_str,
+                           weight, evnum);
+        buf.len = 0;
+        if(tofe_buffer_event_line(&buf, angle1, angle2, energy, Z, mass, type_str, weight, evnum) != len ||
+           buf.len != (size_t) len || memcmp(buf.data, expected, len)) {
+            if(failures++ < 10) {
+                fprintf(stderr, "Line %li differs.\nExpected: %sGot:      %.*s", i, expected, (int) buf.len, buf.data);
+            }
+        }
+    }
+    tofe_buffer_free(&buf);
+    fprintf(stderr, "%li lines compared, %li differ\n", n, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,6 +1,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <limits.h>
+#include <ctype.h>
 #include <jibal.h>
 #include <jibal_stop.h>
 #ifdef WIN32
@@ -12,9 +16,13 @@
 #else
 #include <libgen.h> /* for basename() */
 #include <sys/param.h> /* for MAXPATHLEN */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
-#include "erd_depth_config.h"
 #include "message.h"
+#include "decompress.h"
 #include "tof_in.h"
 #include "tofe_list.h"
 
@@ -25,6 +33,7 @@ void tofe_files_free(list_files *files) {
     for(size_t i = 0; i < files->n_files; i++) {
         cutfile_free(&files->cutfiles[i]);
     }
+    efficiency_cache_free(&files->eff_cache);
     free(files->cutfiles);
     free(files);
 }
@@ -163,29 +172,247 @@ int cutfile_parse_header(cutfile *cutfile, int lineno, const char *header, const
     return 0;
 }
 
+int cutfile_map(cutfile *cutfile) {
+    /* Makes the whole file available in cutfile->map. Pages are read as they are needed. Compressed files are not
+     * mapped or read to memory, cutfile_read_headers() opens a decompression stream. */
+    cutfile_unmap(cutfile);
+    cutfile->compressed = (compression_file_type(cutfile->filename) != COMPRESSION_NONE);
+    if(cutfile->compressed) {
+        return 0;
+    }
+#ifdef WIN32
+    FILE *f = fopen(cutfile->filename, "rb");
+    if(!f) {
+        return -1;
+    }
+    long len = -1;
+    if(fseek(f, 0, SEEK_END) == 0) {
+        len = ftell(f);
+    }
+    if(len < 0 || fseek(f, 0, SEEK_SET)) {
+        fclose(f);
+        return -1;
+    }
+    cutfile->map = malloc(len + 1);
+    if(!cutfile->map || fread(cutfile->map, 1, len, f) != (size_t) len) {
+        free(cutfile->map);
+        cutfile->map = NULL;
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    cutfile->map_len = len;
+    cutfile->map_alloc = TRUE;
+#else
+    int fd = open(cutfile->filename, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    if(st.st_size > 0) { /* Empty files can't be mapped, they have no headers or data either */
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        cutfile->map = map;
+        cutfile->map_len = st.st_size;
+    }
+    close(fd);
+#endif
+    return 0;
+}
+
+static int cutfile_stream_close(cutfile_stream *st);
+
+void cutfile_unmap(cutfile *cutfile) { /* Also closes the stream of the file, if it is still open */
+    cutfile_stream_close(&cutfile->stream);
+    if(!cutfile->map) {
+        return;
+    }
+    if(cutfile->map_alloc) {
+        free(cutfile->map);
+    }
+#ifndef WIN32
+    else {
+        munmap(cutfile->map, cutfile->map_len);
+    }
+#endif
+    cutfile->map = NULL;
+    cutfile->map_alloc = FALSE;
+    cutfile->map_len = 0;
+}
+
+static const char *tofe_line_end(const char *s, const char *end) { /* Start of next line */
+    const char *eol = memchr(s, '\n', end - s);
+    return eol ? eol + 1 : end;
+}
+
+static int cutfile_stream_fill(cutfile_stream *st) {
+    /* Moves the unread part of the chunk to the start of the buffer and reads more, until there is a complete line or
+     * the end of file. The buffer grows if a line doesn't fit. */
+    size_t len = st->end - st->s, scanned = 0;
+    memmove(st->buf, st->s, len);
+    while(!memchr(st->buf + scanned, '\n', len - scanned)) {
+        if(len == st->size) {
+            char *buf = realloc(st->buf, 2 * st->size);
+            if(!buf) {
+                return -1;
+            }
+            st->buf = buf;
+            st->size *= 2;
+        }
+        scanned = len;
+        size_t n = fread(st->buf + len, 1, st->size - len, st->f);
+        if(n == 0) {
+            break;
+        }
+        len += n;
+    }
+    st->s = st->buf;
+    st->end = st->buf + len;
+    return 0;
+}
+
+static int cutfile_stream_open(const cutfile *cutfile, cutfile_stream *st) {
+    /* Lines of the mapped file, or of a compressed file decompressed on a thread of its own (see decompress_fopen()).
+     * Only one chunk of a compressed file is kept in memory at a time. */
+    memset(st, 0, sizeof(cutfile_stream));
+    if(!cutfile->compressed) {
+        st->s = cutfile->map;
+        st->end = cutfile->map + cutfile->map_len;
+        return 0;
+    }
+    st->f = decompress_fopen(cutfile->filename);
+    st->size = CUTFILE_STREAM_CHUNK;
+    st->buf = malloc(st->size);
+    if(!st->f || !st->buf) {
+        if(st->f) {
+            decompress_fclose(st->f);
+        }
+        free(st->buf);
+        return -1;
+    }
+    st->s = st->end = st->buf;
+    return 0;
+}
+
+static const char *cutfile_stream_line(cutfile_stream *st, const char **next) {
+    /* Returns the next line (ending at *next) or NULL at the end of file. The line stays valid until the next call. */
+    if(st->f && !memchr(st->s, '\n', st->end - st->s) && cutfile_stream_fill(st)) {
+        st->error = 1;
+        return NULL;
+    }
+    if(st->s >= st->end) {
+        return NULL;
+    }
+    const char *s = st->s;
+    *next = tofe_line_end(s, st->end);
+    st->s = *next;
+    return s;
+}
+
+static int cutfile_stream_close(cutfile_stream *st) { /* Returns non-zero if decompression failed */
+    int error = st->error;
+    if(st->f && decompress_fclose(st->f)) {
+        error = 1;
+    }
+    free(st->buf);
+    memset(st, 0, sizeof(cutfile_stream));
+    return error;
+}
+
+static int tofe_scan_ints(const char *s, const char *end, int *v, int n_max) {
+    /* Reads up to n_max whitespace separated integers from [s, end). Stops at the first thing that isn't one, like
+     * sscanf() with "%i", so "0x" prefixed numbers are hexadecimal and numbers with a leading zero octal. Returns the
+     * number of integers read. Values out of range are clamped. */
+    int n = 0;
+    while(n < n_max) {
+        while(s < end && (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')) {
+            s++;
+        }
+        int neg = 0;
+        if(s < end && (*s == '-' || *s == '+')) {
+            neg = (*s == '-');
+            s++;
+        }
+        if(s >= end || *s < '0' || *s > '9') {
+            break;
+        }
+        int base = 10;
+        if(*s == '0') {
+            base = 8;
+            if(end - s > 1 && (s[1] == 'x' || s[1] == 'X')) { /* A bare "0x" is zero, as in glibc */
+                base = 16;
+                s += 2;
+            }
+        }
+        long long x = 0;
+        for(; s < end; s++) {
+            int digit;
+            if(*s >= '0' && *s <= '9') {
+                digit = *s - '0';
+            } else if(base == 16 && isxdigit((unsigned char) *s)) {
+                digit = tolower((unsigned char) *s) - 'a' + 10;
+            } else {
+                break;
+            }
+            if(digit >= base) {
+                break;
+            }
+            if(x <= INT_MAX) {
+                x = x * base + digit;
+            }
+        }
+        if(neg) {
+            v[n++] = x > -(long long) INT_MIN ? INT_MIN : (int) -x;
+        } else {
+            v[n++] = x > INT_MAX ? INT_MAX : (int) x;
+        }
+    }
+    return n;
+}
+
 int cutfile_read_headers(cutfile *cutfile) {
-    char *line = NULL, *line_data;
-    size_t line_size = 0;
+    /* Maps the file and parses the headers. The mapping and the stream of lines, which is now at the start of the data,
+     * are kept for cutfile_convert(). Compressed files are decompressed only once, the decompression thread waits
+     * until cutfile_convert() reads more. */
+    char *line, *line_data;
+    const char *s, *next;
     int lineno = 0;
-    FILE *f = fopen(cutfile->filename, "r");
-    if(!f) {
+    cutfile_stream *st = &cutfile->stream;
+    if(cutfile_map(cutfile) || cutfile_stream_open(cutfile, st)) {
         tofe_list_msg(TOFE_LIST_ERROR, "Could not open file \"%s\"", cutfile->filename);
         return -1;
     }
     int error = 0;
-    while(getline(&line, &line_size, f) > 0) {
+    while((s = cutfile_stream_line(st, &next))) {
         lineno++;
-        if(*line == '#') /* Comments are allowed */
+        if(*s == '#') { /* Comments are allowed */
             continue;
-        if(*line == '\r' || *line == '\n') { /* Empty line signals end of headers */
+        }
+        if(*s == '\r' || *s == '\n') { /* Empty line signals end of headers */
             break;
         }
+        line = malloc(next - s + 1);
+        if(!line) {
+            error++;
+            break;
+        }
+        memcpy(line, s, next - s);
+        line[next - s] = '\0';
         line[strcspn(line, "\r\n")] = 0; /* Strips all kinds of newlines! */
         line_data = line;
         strsep(&line_data, ":");
         if(line_data == NULL) { /* No argument, ignore */
             tofe_list_msg(TOFE_LIST_ERROR, "File %s line %i: \"%s\", no argument or separator ':'.", cutfile->filename,
                           lineno, line);
+            free(line);
             error++;
             break;
         }
@@ -193,6 +420,7 @@ int cutfile_read_headers(cutfile *cutfile) {
         if(*line_data == '\0') {
             tofe_list_msg(TOFE_LIST_WARNING, "File %s line %i: \"%s\", argument is empty.", cutfile->filename,
                           lineno, line);
+            free(line);
             continue;
         }
 #ifdef DEBUG
@@ -201,10 +429,13 @@ int cutfile_read_headers(cutfile *cutfile) {
         if(cutfile_parse_header(cutfile, lineno, line, line_data)) {
             error++;
         }
+        free(line);
     }
-    free(line);
     cutfile->header_lines = lineno;
-    fclose(f);
+    if(st->error) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Could not read file \"%s\"", cutfile->filename);
+        error++;
+    }
     return error;
 }
 
@@ -217,9 +448,12 @@ void cutfile_reset(cutfile *cutfile) {
 }
 
 void cutfile_free(cutfile *cutfile) {
+    cutfile_unmap(cutfile);
     free(cutfile->filename);
     free(cutfile->basename);
-    efficiencyfile_free(cutfile->ef);
+    efficiencyfile_release(cutfile->ef);
+    cutfile->ef = NULL;
+    cutfile->ft = NULL;
     jibal_element_free(cutfile->element);
     jibal_element_free(cutfile->element_sample);
 }
@@ -235,48 +469,287 @@ double tofelist_stop(jibal_gsto *workspace, int Z1, double mass, const jibal_mat
     return sum;
 }
 
-int cutfile_convert(jibal *jibal, FILE *out, const tofin_file *tofin, const cutfile *cutfile, const jibal_material *foil) {
-    FILE *in = fopen(cutfile->filename, "r");
-    if(!in) {
-        tofe_list_msg(TOFE_LIST_ERROR, "Could not open file \"%s\" (reading for conversion)!\n", cutfile->filename);
+double tofelist_foil_energy(jibal_gsto *workspace, int Z1, double mass, const jibal_material *foil, double thickness, double E) {
+    /* Energy before the foil of an ion detected with energy E after it. Integrated backwards through the foil (energy
+     * grows with dE/dx = S(E)) using RK4. */
+    double h = thickness / FOIL_RK4_STEPS;
+    for(int i = 0; i < FOIL_RK4_STEPS; i++) {
+        double k1 = tofelist_stop(workspace, Z1, mass, foil, E);
+        double k2 = tofelist_stop(workspace, Z1, mass, foil, E + 0.5 * h * k1);
+        double k3 = tofelist_stop(workspace, Z1, mass, foil, E + 0.5 * h * k2);
+        double k4 = tofelist_stop(workspace, Z1, mass, foil, E + h * k3);
+        E += h * (k1 + 2.0 * k2 + 2.0 * k3 + k4) / 6.0;
+    }
+    return E;
+}
+
+foil_table *foil_table_create(jibal_gsto *workspace, int Z1, double mass, const jibal_material *foil, double thickness, double E_max) {
+    foil_table *ft = calloc(1, sizeof(foil_table));
+    if(!ft) {
+        return NULL;
+    }
+    ft->Z = Z1;
+    ft->mass = mass;
+    ft->gsto = workspace;
+    ft->foil = foil;
+    ft->thickness = thickness;
+    ft->n = FOIL_TABLE_POINTS;
+    ft->E_step = E_max / (ft->n - 1);
+    ft->E = malloc(ft->n * sizeof(double));
+    if(!ft->E) {
+        free(ft);
+        return NULL;
+    }
+    for(size_t i = 0; i < ft->n; i++) {
+        ft->E[i] = tofelist_foil_energy(workspace, Z1, mass, foil, thickness, i * ft->E_step);
+    }
+    return ft;
+}
+
+double foil_table_energy(const foil_table *ft, double E) {
+    double x = E / ft->E_step;
+    if(!(x >= 0.0 && x < ft->n - 1)) { /* Rare, but cutfiles are converted in parallel and jibal_gsto is shared */
+        double E_out;
+#pragma omp critical(tofe_list_gsto)
+        E_out = tofelist_foil_energy(ft->gsto, ft->Z, ft->mass, ft->foil, ft->thickness, E);
+        return E_out;
+    }
+    size_t i = (size_t) x;
+    x -= i;
+    return ft->E[i] + x * (ft->E[i + 1] - ft->E[i]);
+}
+
+void foil_table_free(foil_table *ft) {
+    if(!ft) {
+        return;
+    }
+    free(ft->E);
+    free(ft);
+}
+
+int tofe_buffer_reserve(tofe_buffer *buf, size_t n) { /* Makes room for n more bytes (and a terminating '\0') */
+    if(buf->len + n + 1 <= buf->size) {
+        return 0;
+    }
+    size_t size = buf->size ? buf->size : TOFE_BUFFER_INITIAL_ALLOC;
+    while(size < buf->len + n + 1) {
+        size *= 2;
+    }
+    char *data = realloc(buf->data, size);
+    if(!data) {
         return -1;
     }
-    char *line = NULL;
-    size_t line_size = 0;
-    int lineno = 0;
+    buf->data = data;
+    buf->size = size;
+    return 0;
+}
+
+int tofe_buffer_printf(tofe_buffer *buf, const char *restrict format, ...) {
+    va_list ap;
+    int n;
+    if(tofe_buffer_reserve(buf, 0)) {
+        return -1;
+    }
+    va_start(ap, format);
+    n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+    va_end(ap);
+    if(n < 0) {
+        return -1;
+    }
+    if(buf->len + n + 1 > buf->size) { /* Did not fit, grow and try again */
+        if(tofe_buffer_reserve(buf, n)) {
+            return -1;
+        }
+        va_start(ap, format);
+        vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
+        va_end(ap);
+    }
+    buf->len += n;
+    return n;
+}
+
+static char *tofe_format_fixed(char *s, double x, int width, int prec, char sep) {
+    /* Same as sprintf(s, "%*.*f%c", width, prec, x, sep), for prec <= 5, but much faster. Returns end of the written
+     * string or NULL if x is too large, not finite or so close to a rounding tie that scaling it might have rounded it
+     * the wrong way. Does nothing if s is NULL, so calls can be chained. */
+    static const double scale[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5};
+    char digits[32];
+    int n = 0;
+    if(!s || !(fabs(x) < TOFE_FORMAT_FAST_MAX) || prec < 0 || prec > 5) {
+        return NULL;
+    }
+    double y = fabs(x) * scale[prec];
+    double f = floor(y);
+    if(fabs(y - f - 0.5) < TOFE_FORMAT_TIE_EPS) {
+        return NULL;
+    }
+    unsigned long long v = (unsigned long long) f + (y - f > 0.5);
+    do { /* Digits in reverse, at least one before the decimal point */
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while(v || n <= prec);
+    int len = n + (prec > 0) + (signbit(x) ? 1 : 0); /* Also negative numbers rounding to zero get a sign, like in printf */
+    for(; len < width; width--) {
+        *s++ = ' ';
+    }
+    if(signbit(x)) {
+        *s++ = '-';
+    }
+    while(n > prec) {
+        *s++ = digits[--n];
+    }
+    if(prec > 0) {
+        *s++ = '.';
+        while(n > 0) {
+            *s++ = digits[--n];
+        }
+    }
+    *s++ = sep;
+    return s;
+}
+
+static char *tofe_format_int(char *s, int i, int width, char sep) { /* Same as sprintf(s, "%*i%c", width, i, sep) */
+    char digits[16];
+    int n = 0;
+    if(!s) {
+        return NULL;
+    }
+    unsigned int v = i < 0 ? 0U - (unsigned int) i : (unsigned int) i;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while(v);
+    for(int len = n + (i < 0); len < width; width--) {
+        *s++ = ' ';
+    }
+    if(i < 0) {
+        *s++ = '-';
+    }
+    while(n > 0) {
+        *s++ = digits[--n];
+    }
+    *s++ = sep;
+    return s;
+}
+
+static char *tofe_format_str(char *s, const char *str, size_t len, int width, char sep) { /* Same as sprintf(s, "%*s%c", width, str, sep) */
+    if(!s) {
+        return NULL;
+    }
+    for(; len < (size_t) width; width--) {
+        *s++ = ' ';
+    }
+    memcpy(s, str, len);
+    s += len;
+    *s++ = sep;
+    return s;
+}
+
+int tofe_buffer_event_line(tofe_buffer *buf, double angle1, double angle2, double energy, int Z, double mass, const char *type_str, double weight, int evnum) {
+    /* Appends "%8.5lf %8.5lf %8.5lf %3i %8.4lf %3s %8.5lf %8i\n" formatted line to buf. Output is identical to
+     * tofe_buffer_printf(), which is still used when one of the numbers can not be formatted by tofe_format_fixed(). */
+    size_t type_len = strlen(type_str);
+    if(tofe_buffer_reserve(buf, TOFE_EVENT_LINE_MAX + type_len)) {
+        return -1;
+    }
+    char *start = buf->data + buf->len;
+    char *s = tofe_format_fixed(start, angle1, 8, 5, ' ');
+    s = tofe_format_fixed(s, angle2, 8, 5, ' ');
+    s = tofe_format_fixed(s, energy, 8, 5, ' ');
+    s = tofe_format_int(s, Z, 3, ' ');
+    s = tofe_format_fixed(s, mass, 8, 4, ' ');
+    s = tofe_format_str(s, type_str, type_len, 3, ' ');
+    s = tofe_format_fixed(s, weight, 8, 5, ' ');
+    s = tofe_format_int(s, evnum, 8, '\n');
+    if(!s) {
+        return tofe_buffer_printf(buf, "%8.5lf %8.5lf %8.5lf %3i %8.4lf %3s %8.5lf %8i\n", angle1, angle2, energy, Z, mass, type_str, weight, evnum);
+    }
+    *s = '\0';
+    buf->len += s - start;
+    return (int)(s - start);
+}
+
+void tofe_buffer_free(tofe_buffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+}
+
+int tofe_events_add(tofe_events *events, const tofe_event *event) {
+    if(events->n == events->size) {
+        size_t size = events->size ? 2 * events->size : TOFE_EVENTS_INITIAL_ALLOC;
+        tofe_event *e = realloc(events->event, size * sizeof(tofe_event));
+        if(!e) {
+            return -1;
+        }
+        events->event = e;
+        events->size = size;
+    }
+    events->event[events->n] = *event;
+    events->n++;
+    return 0;
+}
+
+void tofe_events_free(tofe_events *events) {
+    free(events->event);
+    events->event = NULL;
+    events->n = 0;
+    events->size = 0;
+}
+
+int cutfile_convert(tofe_buffer *out, tofe_events *events, const tofin_file *tofin, cutfile *cutfile) {
+    /* Converts data of a file opened by cutfile_read_headers(), continuing from where the headers ended. The stream is
+     * closed afterwards. Events are formatted as text to out, or if it is NULL, stored in events. */
+    cutfile_stream *st = &cutfile->stream;
+    const char *s, *next;
+    if(!st->f && !cutfile->map && cutfile->n_counts) {
+        tofe_list_msg(TOFE_LIST_ERROR, "File \"%s\" is not open for conversion!\n", cutfile->filename);
+        return -1;
+    }
+    int lineno = cutfile->header_lines;
     const int Z_out = cutfile->element_sample->Z;
     const double mass_out = cutfile->element_sample->avg_mass / C_U;
     double weight_cutfile = cutfile->event_weight;
     const char *type_str = tofe_scatter_types[cutfile->type].s;
     size_t n_counts = 0;
     double weight_avg = 0.0;
-    while(getline(&line, &line_size, in) > 0) {
+    const uint64_t key = tofe_random_key(tofin->random_seed, cutfile->basename);
+    tofe_list_msg_site eff_range, eff_low;
+    tofe_list_msg_site_init(&eff_range, "efficiency_out_of_range", "energy out of range of efficiency file, weight set to zero", "MeV", TOFE_LIST_WARNING, TOFE_LIST_MSG_LIMIT);
+    tofe_list_msg_site_init(&eff_low, "efficiency_too_low", "efficiency too low, weight set to zero", "MeV", TOFE_LIST_WARNING, TOFE_LIST_MSG_LIMIT);
+    while((s = cutfile_stream_line(st, &next))) {
         lineno++;
-        if(lineno <= cutfile->header_lines) {
-            continue;
-        }
-        if(strncmp(line, "ToF, Energy, Event number", 25) == 0) { /* TODO: this is for backward compatibility, consider removing! */
+        if(next - s >= 25 && memcmp(s, "ToF, Energy, Event number", 25) == 0) { /* TODO: this is for backward compatibility, consider removing! */
             continue;
         }
-        int tof, e, ang1, evnum;
+        int v[4];
+        int tof, evnum;
         double angle1, angle2 = 0.0;
-        if(sscanf(line, "%i %i %i %i", &tof, &e, &ang1, &evnum) == 4) {
-            angle1 = ang1 * tofin->angle_slope + tofin->angle_offset;
-        } else if(sscanf(line, "%i %i %i", &tof, &e, &evnum) == 3) {
+        int n = tofe_scan_ints(s, next, v, 4);
+        if(n == 4) { /* ToF, energy, angle, event number */
+            tof = v[0];
+            angle1 = v[2] * tofin->angle_slope + tofin->angle_offset;
+            evnum = v[3];
+        } else if(n == 3) { /* ToF, energy, event number */
+            tof = v[0];
             angle1 = 0.0;
+            evnum = v[2];
         } else {
-            tofe_list_msg(TOFE_LIST_ERROR, "Error in scanning input file %s on line %i: %s", cutfile->filename, lineno, line);
+            tofe_list_msg(TOFE_LIST_ERROR, "Error in scanning input file %s on line %i: %.*s", cutfile->filename, lineno, (int)(next - s), s);
             break;
         }
-        double energy = energy_from_tof(tofin, tof, cutfile->element->avg_mass);
-        double stop = tofelist_stop(jibal->gsto, cutfile->element->Z, cutfile->element->avg_mass, foil, energy) * tofin->foil_thickness;
-        energy += stop;
+        double energy = energy_from_tof(tofin, tof, cutfile->element->avg_mass, tofe_random(key, n_counts));
+        energy = foil_table_energy(cutfile->ft, energy);
 
         double weight = weight_cutfile;
         if(cutfile->ef) {
             double eff = efficiencyfile_get_weight(cutfile->ef, energy);
-            if(eff < 1e-6) {
-                tofe_list_msg(TOFE_LIST_WARNING, "Efficiency %g too low, setting weight of count (event number = %i, line number = %i) in file %s to zero.\n", eff, evnum, lineno, cutfile->basename);
+            if(!efficiencyfile_in_range(cutfile->ef, energy)) {
+                tofe_list_msg_limited(&eff_range, energy / C_MEV, "Energy %g MeV is out of range of efficiency file, setting weight of count (event number = %i, line number = %i) in file %s to zero.", energy / C_MEV, evnum, lineno, cutfile->basename);
+                weight = 0.0;
+            } else if(eff < 1e-6) {
+                tofe_list_msg_limited(&eff_low, energy / C_MEV, "Efficiency %g too low, setting weight of count (event number = %i, line number = %i) in file %s to zero.", eff, evnum, lineno, cutfile->basename);
                 weight = 0.0;
             } else {
                 weight *= 1.0 / eff;
@@ -284,11 +757,26 @@ int cutfile_convert(jibal *jibal, FILE *out, const tofin_file *tofin, const cutf
         }
         weight_avg += weight;
 
-        fprintf(out, "%8.5lf %8.5lf %8.5lf %3i %8.4lf %3s %8.5lf %8i\n", angle1, angle2, energy / C_MEV, Z_out, mass_out, type_str, weight, evnum);
+        if(out) {
+            if(tofe_buffer_event_line(out, angle1, angle2, energy / C_MEV, Z_out, mass_out, type_str, weight, evnum) < 0) {
+                tofe_list_msg(TOFE_LIST_ERROR, "Could not allocate output buffer for file \"%s\".", cutfile->filename);
+                break;
+            }
+        } else {
+            tofe_event ev = {angle1, angle2, energy, Z_out, cutfile->element_sample->avg_mass, cutfile->type, weight, evnum};
+            if(tofe_events_add(events, &ev)) {
+                tofe_list_msg(TOFE_LIST_ERROR, "Could not allocate events of file \"%s\".", cutfile->filename);
+                break;
+            }
+        }
         n_counts++;
     }
-    fclose(in);
-    free(line);
+    tofe_list_msg_summary(&eff_range, cutfile->basename);
+    tofe_list_msg_summary(&eff_low, cutfile->basename);
+    if(cutfile_stream_close(st)) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Could not read file \"%s\"", cutfile->filename);
+        return -1;
+    }
     if(n_counts != cutfile->n_counts) {
         tofe_list_msg(TOFE_LIST_ERROR, "Number of counts expected in file \"%s\" was %zu, but I got %zu.", cutfile->filename, cutfile->n_counts, n_counts);
         return -1;
@@ -303,28 +791,35 @@ list_files *tofe_files_from_argv(jibal *jibal, const tofin_file *tofin, int argc
         tofe_list_msg(TOFE_LIST_ERROR, "No files.");
         return NULL;
     }
-    list_files *files = malloc(sizeof(list_files));
+    list_files *files = calloc(1, sizeof(list_files));
     files->n_files = argc;
     files->cutfiles = calloc(files->n_files, sizeof(cutfile));
     if(!files->cutfiles) {
         return NULL;
     }
     int error = 0;
-    for(int i = 0; i < argc; i++) {
+    for(int i = 0; i < argc; i++) { /* basename() and JIBAL element lookups are not known to be thread safe */
         cutfile *cutfile = &files->cutfiles[i];
         cutfile_reset(cutfile);
         cutfile->filename = strdup(argv[i]);
         if(cutfile_parse_filename(jibal, cutfile)) {
             error = 1;
-            break;
         }
+    }
+    if(error) {
+        tofe_files_free(files);
+        return NULL;
+    }
+#pragma omp parallel for schedule(dynamic, 1) reduction(||:error)
+    for(int i = 0; i < argc; i++) { /* Files are independent, headers are read in parallel */
+        cutfile *cutfile = &files->cutfiles[i];
         if(cutfile_read_headers(cutfile)) { /* Encountered some error, cleanup and return */
             error = 1;
-            break;
+            continue;
         }
-        if(cutfile_load_efficiencyfile(cutfile, tofin)) {
+        if(cutfile_load_efficiencyfile(cutfile, tofin, &files->eff_cache)) {
             tofe_list_msg(TOFE_LIST_ERROR, "Error while loading efficiency file for cutfile \"%s\" (%s)\n", cutfile->filename, cutfile->element->name);
-            return NULL;
+            error = 1;
         }
     }
     if(error) {
@@ -385,16 +880,92 @@ void tofe_files_print(list_files *files) {
     }
 }
 
-int tofe_files_convert(jibal *jibal, const tofin_file *tofin, list_files *files, const jibal_material *foil) {
+int tofe_files_convert(jibal *jibal, const tofin_file *tofin, list_files *files, const jibal_material *foil, const tofe_sink *sink) {
+    /* Events are written to stdout as text, or given to sink if it is not NULL */
     size_t n_eff = 0;
     size_t eff_str_len = 1; /* must have at least terminating \0 */
     char *eff_str = NULL;
+    int error = 0;
+    tofe_buffer *buffers = calloc(files->n_files, sizeof(tofe_buffer));
+    tofe_events *events = calloc(files->n_files, sizeof(tofe_events));
+    foil_table **tables = calloc(files->n_files, sizeof(foil_table *));
+    if(!buffers || !events || !tables) {
+        free(buffers);
+        free(events);
+        free(tables);
+        return -1;
+    }
+    double E_max = tofin->beam_energy > 0.0 ? FOIL_TABLE_EMAX_FACTOR * tofin->beam_energy : FOIL_TABLE_EMAX_DEFAULT;
+    /* One foil correction table for each element and mass, the first cutfile with them builds it. Tables are built
+     * serially, since jibal_gsto is not known to be thread safe. */
+    for(size_t i = 0; i < files->n_files; i++) {
+        const jibal_element *element = files->cutfiles[i].element;
+        size_t j;
+        for(j = 0; j < i; j++) {
+            if(files->cutfiles[j].element->Z == element->Z && files->cutfiles[j].element->avg_mass == element->avg_mass)
+                break;
+        }
+        if(j < i) {
+            continue;
+        }
+        tables[i] = foil_table_create(jibal->gsto, element->Z, element->avg_mass, foil, tofin->foil_thickness, E_max);
+        if(!tables[i]) {
+            tofe_list_msg(TOFE_LIST_ERROR, "Could not create foil correction table for \"%s\".", files->cutfiles[i].filename);
+            error = 1;
+        }
+    }
+    for(size_t i = 0; i < files->n_files; i++) {
+        cutfile *cutfile = &files->cutfiles[i];
+        for(size_t j = 0; j <= i; j++) {
+            if(tables[j] && tables[j]->Z == cutfile->element->Z && tables[j]->mass == cutfile->element->avg_mass) {
+                cutfile->ft = tables[j];
+                break;
+            }
+        }
+    }
+    /* Each cutfile is converted to its own buffer. Buffers are written in the order of the files, as soon as all the
+     * files before them are done, so the output is the same as when converting files one by one. */
+#pragma omp parallel for schedule(dynamic, 1) ordered
     for(size_t i = 0; i < files->n_files; i++) {
         cutfile *cutfile =  &files->cutfiles[i];
-        if(cutfile_convert(jibal, stdout, tofin, cutfile, foil)) {
-            tofe_list_msg(TOFE_LIST_ERROR, "Error while processing cutfile \"%s\"\n", cutfile->filename);
-            return -1;
+        int ret = 0, failed;
+#pragma omp atomic read
+        failed = error;
+        if(!failed) { /* Files after an error are not converted, the check inside the ordered block is what counts */
+            ret = cutfile_convert(sink ? NULL : &buffers[i], &events[i], tofin, cutfile);
         }
+        cutfile_unmap(cutfile);
+#pragma omp ordered
+        {
+            if(!error && ret) {
+                tofe_list_msg(TOFE_LIST_ERROR, "Error while processing cutfile \"%s\"\n", cutfile->filename);
+#pragma omp atomic write
+                error = 1;
+            }
+            if(!error && buffers[i].len) {
+                fwrite(buffers[i].data, 1, buffers[i].len, stdout);
+            }
+            if(!error && sink && sink->events(sink->data, cutfile, events[i].event, events[i].n)) {
+                tofe_list_msg(TOFE_LIST_ERROR, "Events of cutfile \"%s\" were not accepted.", cutfile->filename);
+#pragma omp atomic write
+                error = 1;
+            }
+            tofe_buffer_free(&buffers[i]);
+            tofe_events_free(&events[i]);
+        }
+    }
+    free(buffers);
+    free(events);
+    for(size_t i = 0; i < files->n_files; i++) {
+        files->cutfiles[i].ft = NULL;
+        foil_table_free(tables[i]);
+    }
+    free(tables);
+    if(error) {
+        return -1;
+    }
+    for(size_t i = 0; i < files->n_files; i++) {
+        cutfile *cutfile =  &files->cutfiles[i];
         if(cutfile->ef) {
             n_eff++;
             eff_str_len += strlen(cutfile->ef->basename) + 3; /* +3 to account for spaces between names and quotes around them */
@@ -434,8 +1005,54 @@ int tofe_files_assign_stopping(jibal *jibal, const list_files *files, const jiba
     return 0;
 }
 
-double energy_from_tof(const tofin_file *tofin, int ch, double mass) {
-    double tof = ((double)ch + ((double)(rand())/RAND_MAX) - 0.5) * tofin->tof_slope + tofin->tof_offset;
+jibal_material *tofe_files_stopping(jibal *jibal, tofin_file *tofin, const list_files *files) {
+    /* Creates the carbon foil, converts its thickness to tfu and assigns and loads stopping of the cutfile elements in
+     * it. Returns the foil, which the caller should free, or NULL on error. */
+    jibal_material *foil = jibal_material_create(jibal->elements, "C");
+    if(!foil) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Could not create carbon foil data structure. JIBAL issue?\n");
+        return NULL;
+    }
+    tofin->foil_thickness /= foil->elements[0].avg_mass; /* TODO: works only on monoelemental foils. Not a massive issue, giving foil thickness in ug/cm2 is quite stupid in this case. */
+    tofe_list_msg(TOFE_LIST_INFO, "Carbon foil thickness %g tfu", tofin->foil_thickness / C_TFU);
+    tofe_list_msg(TOFE_LIST_INFO, "ToF length %g m, calibration slope %.6lf ns/ch, offset %.3lf ns", tofin->toflen, tofin->tof_slope / C_NS, tofin->tof_offset / C_NS);
+    if(tofe_files_assign_stopping(jibal, files, foil)) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Could not assign stopping. JIBAL issue?");
+        jibal_material_free(foil);
+        return NULL;
+    }
+    if(jibal_gsto_load_all(jibal->gsto) == 0) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Could not load stopping. JIBAL issue?");
+        jibal_material_free(foil);
+        return NULL;
+    }
+    return foil;
+}
+
+uint64_t tofe_random_key(uint64_t seed, const char *name) { /* Key of a random stream, FNV-1a hash of name mixed with the seed */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(const unsigned char *s = (const unsigned char *) name; *s; s++) {
+        h ^= *s;
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (seed * 0x9e3779b97f4a7c15ULL);
+}
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+double tofe_random(uint64_t key, uint64_t counter) {
+    /* Counter based uniform random number in [0, 1). The same key and counter always give the same number, so
+     * results don't depend on the order events or files are processed in. */
+    return (double) (splitmix64(key ^ splitmix64(counter)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double energy_from_tof(const tofin_file *tofin, int ch, double mass, double dither) { /* dither is uniform in [0, 1) */
+    double tof = ((double)ch + dither - 0.5) * tofin->tof_slope + tofin->tof_offset;
     //fprintf(stdout, "tof = %g s, ch = %i mass = %g\n", tof, ch, mass / C_U);
     if(tof < 1.0 * C_NS) {
         return 0.0;
@@ -467,6 +1084,7 @@ efficiencyfile *efficiencyfile_load(const char *filename, int *error_out) {
     }
     efficiencyfile *ef = calloc(1, sizeof(efficiencyfile));
     ef->basename = tofe_basename(filename);
+    ef->refs = 1;
     char *line = NULL;
     size_t line_size = 0;
     size_t n = 0;
@@ -519,17 +1137,127 @@ efficiencyfile *efficiencyfile_load(const char *filename, int *error_out) {
         return NULL;
     }
     tofe_list_msg(TOFE_LIST_INFO, "Got %zu points (in %zu lines) from efficiency file \"%s\". Highest energy %g MeV. Simple arithmetic average of efficiencies: %g.", n, lineno, filename, ef->p[n-1].E / C_MEV, eff_avg);
+    if(efficiencyfile_index_build(ef)) {
+        tofe_list_msg(TOFE_LIST_WARNING, "Energies in efficiency file \"%s\" are not in ascending order. Lookups will be slow.", filename);
+    }
     return ef;
 }
+
+int efficiencyfile_index_build(efficiencyfile *ef) {
+    /* Divides the energy range of the file into uniform buckets and stores the interval where each bucket starts. A
+     * lookup then starts from the right interval (or very close to it) instead of doing a binary search. Returns -1 and
+     * leaves index NULL if energies are not sorted (or the range is empty). */
+    free(ef->index);
+    ef->index = NULL;
+    ef->n_index = 0;
+    for(size_t i = 1; i < ef->n_points; i++) {
+        if(ef->p[i].E < ef->p[i - 1].E) {
+            return -1;
+        }
+    }
+    double range = ef->p[ef->n_points - 1].E - ef->p[0].E;
+    if(!(range > 0.0)) {
+        return -1;
+    }
+    size_t n_index = (ef->n_points - 1) * EFFICIENCY_INDEX_BUCKETS_PER_POINT;
+    ef->index = malloc(n_index * sizeof(size_t));
+    if(!ef->index) {
+        return -1;
+    }
+    ef->n_index = n_index;
+    ef->index_scale = n_index / range;
+    size_t lo = 0;
+    for(size_t k = 0; k < n_index; k++) {
+        double E = ef->p[0].E + k / ef->index_scale;
+        while(lo + 2 < ef->n_points && E >= ef->p[lo + 1].E) {
+            lo++;
+        }
+        ef->index[k] = lo;
+    }
+    return 0;
+}
+
 void efficiencyfile_free(efficiencyfile *ef) {
     if(!ef) {
         return;
     }
     free(ef->basename);
     free(ef->p);
+    free(ef->index);
     free(ef);
 }
 
+void efficiencyfile_release(efficiencyfile *ef) { /* Drops one reference, the file is freed when there are none left */
+    int refs;
+    if(!ef) {
+        return;
+    }
+#pragma omp atomic capture
+    refs = --ef->refs;
+    if(refs == 0) {
+        efficiencyfile_free(ef);
+    }
+}
+
+efficiencyfile *efficiency_cache_get(efficiency_cache *cache, const char *filename, int *error_out) {
+    /* Loads an efficiency file or finds it from the cache if it has been loaded before, using the resolved path to
+     * tell files apart. Caller gets a reference and should release it with efficiencyfile_release(). Missing files
+     * are cached too, they give NULL with *error_out = FALSE just like efficiencyfile_load(). Safe to call from
+     * parallel threads, loading is serialized. */
+    char resolved[PATH_MAX];
+    const char *path = realpath(filename, resolved) ? resolved : filename;
+    efficiencyfile *ef = NULL;
+    *error_out = FALSE;
+#pragma omp critical (efficiency_cache)
+    {
+        size_t i;
+        for(i = 0; i < cache->n; i++) {
+            if(strcmp(cache->paths[i], path) == 0) {
+                break;
+            }
+        }
+        if(i < cache->n) {
+            ef = cache->ef[i];
+        } else {
+            ef = efficiencyfile_load(filename, error_out);
+            char **paths = realloc(cache->paths, (cache->n + 1) * sizeof(char *));
+            if(paths) {
+                cache->paths = paths;
+            }
+            efficiencyfile **efs = realloc(cache->ef, (cache->n + 1) * sizeof(efficiencyfile *));
+            if(efs) {
+                cache->ef = efs;
+            }
+            if(!*error_out && paths && efs) { /* The cache keeps the reference of the load, errors are not cached */
+                cache->paths[cache->n] = strdup(path);
+                cache->ef[cache->n] = ef;
+                cache->n++;
+            } else {
+                efficiencyfile_release(ef);
+                ef = NULL;
+                *error_out = TRUE;
+            }
+        }
+        if(ef) { /* Atomic, efficiencyfile_release() may run outside of this critical section at the same time */
+#pragma omp atomic
+            ef->refs++;
+        }
+    }
+    return ef;
+}
+
+void efficiency_cache_free(efficiency_cache *cache) {
+    for(size_t i = 0; i < cache->n; i++) {
+        free(cache->paths[i]);
+        efficiencyfile_release(cache->ef[i]);
+    }
+    free(cache->paths);
+    free(cache->ef);
+    cache->paths = NULL;
+    cache->ef = NULL;
+    cache->n = 0;
+}
+
 char *cutfile_efficiencyfile_name(const cutfile *cutfile, const tofin_file *tofin) {
     if(!cutfile || !tofin || !tofin->efficiency_directory) {
         return NULL;
@@ -542,22 +1270,53 @@ char *cutfile_efficiencyfile_name(const cutfile *cutfile, const tofin_file *tofi
     return filename;
 }
 
-int cutfile_load_efficiencyfile(cutfile *cutfile, const tofin_file *tofin) {
+int cutfile_load_efficiencyfile(cutfile *cutfile, const tofin_file *tofin, efficiency_cache *cache) { /* cache can be NULL */
     char *eff_filename = cutfile_efficiencyfile_name(cutfile, tofin);
     if(!eff_filename) {
         tofe_list_msg(TOFE_LIST_ERROR, "Efficiency filename error.");
         return -1;
     }
     int error = 0;
-    cutfile->ef = efficiencyfile_load(eff_filename, &error);
+    if(cache) {
+        cutfile->ef = efficiency_cache_get(cache, eff_filename, &error);
+    } else {
+        cutfile->ef = efficiencyfile_load(eff_filename, &error);
+    }
     if(error) {
         tofe_list_msg(TOFE_LIST_ERROR, "Error while loading efficiency file \"%s\".", eff_filename);
+        free(eff_filename);
         return -1;
     }
+    free(eff_filename);
     return 0;
 }
 
-double efficiencyfile_get_weight(efficiencyfile *ef, double E) {
+int efficiencyfile_in_range(const efficiencyfile *ef, double E) {
+    return E >= ef->p[0].E && E <= ef->p[ef->n_points - 1].E;
+}
+
+double efficiencyfile_get_weight(const efficiencyfile *ef, double E) {
+    /* Same result as efficiencyfile_get_weight_exact(), the interval is found using the index. Out of bounds energies
+     * give zero efficiency silently, the caller warns about zero weights. */
+    if(!ef->index) {
+        return efficiencyfile_get_weight_exact(ef, E);
+    }
+    const efficiencypoint *p = ef->p;
+    if(!(E >= p[0].E && E <= p[ef->n_points - 1].E)) {
+        return 0.0;
+    }
+    size_t k = (size_t)((E - p[0].E) * ef->index_scale);
+    size_t lo = ef->index[k < ef->n_index ? k : ef->n_index - 1];
+    while(lo > 0 && E < p[lo].E) { /* Only needed if E fell into the previous bucket due to rounding */
+        lo--;
+    }
+    while(lo + 2 < ef->n_points && E >= p[lo + 1].E) {
+        lo++;
+    }
+    return jibal_linear_interpolation(p[lo].E, p[lo + 1].E, p[lo].eff, p[lo + 1].eff, E);
+}
+
+double efficiencyfile_get_weight_exact(const efficiencyfile *ef, double E) { /* Binary search of the original points */
     size_t lo = 0, mi, hi = ef->n_points - 1;
     while (hi - lo > 1) {
         mi = (hi + lo) / 2;
@@ -567,8 +1326,7 @@ double efficiencyfile_get_weight(efficiencyfile *ef, double E) {
             hi = mi;
         }
     }
-    if(E > ef->p[ef->n_points - 1].E || E < ef->p[0].E) {
-        tofe_list_msg(TOFE_LIST_WARNING, "Energy %g MeV is out of bounds for efficiency file. Assuming zero efficiency!\n", E / C_MEV);
+    if(!efficiencyfile_in_range(ef, E)) { /* Zero efficiency, reported by the caller */
         return 0.0;
     }
     double out = jibal_linear_interpolation(ef->p[lo].E, ef->p[lo + 1].E, ef->p[lo].eff, ef->p[lo + 1].eff, E);
@@ -577,62 +1335,3 @@ double efficiencyfile_get_weight(efficiencyfile *ef, double E) {
 #endif
     return out;
 }
-
-
-int main(int argc, char **argv) {
-    tofe_list_msg(TOFE_LIST_INFO, "tofe_list (erd_depth) version %s", ERD_DEPTH_VERSION);
-#ifdef DEBUG
-    for(int i = 0; i < argc; i++) {
-        fprintf(stderr, "tofe_list argv[%i] = %s\n", i, argv[i]);
-    }
-#endif
-    if(argc < 3) {
-        tofe_list_msg(TOFE_LIST_ERROR, "Not enough arguments. Usage: tofe_list <tof.in file> <cutfile1> <cutfile2> ...");
-        return EXIT_FAILURE;
-    }
-    jibal *jibal = jibal_init(NULL);
-    if(!jibal) {
-        tofe_list_msg(TOFE_LIST_ERROR, "JIBAL initialization by tofe_list failed.");
-        return EXIT_FAILURE;
-    }
-    argc--;
-    argv++;
-    tofin_file *tofin = tofin_file_load(argv[0]);
-    if(!tofin) {
-        tofe_list_msg(TOFE_LIST_ERROR, "Could not load or parse settings file \"%s\".", argv[0]);
-        return EXIT_FAILURE;
-    }
-    argc--;
-    argv++;
-    list_files *files = tofe_files_from_argv(jibal, tofin, argc, argv);
-    if(!files) {
-        tofe_list_msg(TOFE_LIST_ERROR, "Error in reading cutfiles.");
-        return EXIT_FAILURE;
-    }
-    tofe_files_print(files);
-    jibal_material *foil = jibal_material_create(jibal->elements, "C");
-    if(!foil) {
-        tofe_list_msg(TOFE_LIST_ERROR, "Could not create carbon foil data structure. JIBAL issue?\n");
-        return EXIT_FAILURE;
-    }
-    tofin->foil_thickness /= foil->elements[0].avg_mass; /* TODO: works only on monoelemental foils. Not a massive issue, giving foil thickness in ug/cm2 is quite stupid in this case. */
-    tofe_list_msg(TOFE_LIST_INFO, "Carbon foil thickness %g tfu", tofin->foil_thickness / C_TFU);
-    tofe_list_msg(TOFE_LIST_INFO, "ToF length %g m, calibration slope %.6lf ns/ch, offset %.3lf ns", tofin->toflen, tofin->tof_slope / C_NS, tofin->tof_offset / C_NS);
-    if(tofe_files_assign_stopping(jibal, files, foil)) {
-        tofe_list_msg(TOFE_LIST_ERROR, "Could not assign stopping. JIBAL issue?");
-        return EXIT_FAILURE;
-    }
-    if(jibal_gsto_load_all(jibal->gsto) == 0) {
-        tofe_list_msg(TOFE_LIST_ERROR, "Could not load stopping. JIBAL issue?");
-        return EXIT_FAILURE;
-    }
-    jibal_gsto_print_assignments(jibal->gsto);
-    tofe_list_msg(TOFE_LIST_INFO, "Starting conversion of %zu cutfiles.", files->n_files);
-    tofe_files_convert(jibal, tofin, files, foil);
-    jibal_material_free(foil);
-    tofe_files_free(files);
-    tofin_file_free(tofin);
-    jibal_free(jibal);
-    tofe_list_msg(TOFE_LIST_INFO, "Clean exit from tofe_list. Have a nice day.");
-    return EXIT_SUCCESS;
-}
@@ -1,9 +1,22 @@
 #ifndef TOFE_LIST_H
 #define TOFE_LIST_H
 
+#include <stdio.h>
 #include <jibal_option.h>
 
 #define EFFICIENCY_FILE_POINTS_INITIAL_ALLOC (1024)
+#define EFFICIENCY_INDEX_BUCKETS_PER_POINT (4) /* Size of efficiency lookup index relative to number of intervals */
+#define TOFE_BUFFER_INITIAL_ALLOC (1024*1024)
+#define TOFE_EVENTS_INITIAL_ALLOC (16384)
+#define CUTFILE_STREAM_CHUNK (256*1024) /* Decompressed data of compressed cutfiles is read in chunks of this size */
+#define FOIL_TABLE_POINTS (2048) /* Energies in a foil correction table */
+#define FOIL_TABLE_EMAX_FACTOR (1.5) /* Tables extend to this times beam energy */
+#define FOIL_TABLE_EMAX_DEFAULT (100.0*C_MEV) /* Extent of tables when beam energy is not known */
+#define FOIL_RK4_STEPS (8) /* Steps through the foil */
+#define TOFE_FORMAT_FAST_MAX (1e6) /* Fixed point numbers smaller than this in magnitude are formatted without printf */
+#define TOFE_FORMAT_TIE_EPS (1e-4) /* Fractions (of last digit) this close to one half are formatted with printf */
+#define TOFE_EVENT_LINE_MAX (128) /* Space reserved for one event line (without type string) */
+#define TOFE_LIST_SUMMARY_OPTION "--summary="
 
 typedef enum scatter_type {
     SCATTER_NONE = 0,
@@ -27,8 +40,38 @@ typedef struct efficiencyfile {
     char *basename;
     efficiencypoint *p;
     size_t n_points;
+    size_t *index; /* Uniform energy buckets, index[k] is the interval (of p) where bucket k starts. NULL if energies are not sorted. */
+    size_t n_index;
+    double index_scale; /* Buckets per unit energy */
+    int refs; /* Cutfiles and caches using this file, freed by efficiencyfile_release() when the last one is done */
 } efficiencyfile;
 
+typedef struct efficiency_cache { /* Efficiency files loaded so far, cutfiles of the same element share them */
+    char **paths; /* Resolved paths of files */
+    efficiencyfile **ef; /* NULL if the file does not exist */
+    size_t n;
+} efficiency_cache;
+
+typedef struct foil_table { /* Energy before the carbon foil as a function of the detected energy */
+    int Z;
+    double mass;
+    jibal_gsto *gsto; /* Energies beyond the table are calculated directly */
+    const jibal_material *foil;
+    double thickness;
+    double E_step;
+    size_t n;
+    double *E; /* E[i] is the energy before the foil when i*E_step is detected, i = 0..n-1 */
+} foil_table;
+
+typedef struct cutfile_stream { /* Lines of a cutfile, from the mapping or from a decompression stream */
+    FILE *f; /* NULL if the file is mapped */
+    char *buf; /* Chunk of decompressed data, NULL if the file is mapped */
+    size_t size;
+    const char *s; /* Next line */
+    const char *end;
+    int error; /* Buffer could not be grown */
+} cutfile_stream;
+
 typedef struct cutfile {
     char *filename;
     char *basename; /* File without full path */
@@ -38,14 +81,49 @@ typedef struct cutfile {
     jibal_isotope *incident;
     double event_weight;
     int header_lines;
+    char *map; /* Contents of the file, mapped (or read on Windows) by cutfile_read_headers(), NULL if compressed */
+    size_t map_len;
+    int map_alloc; /* map was allocated (and read) instead of mapped */
+    int compressed; /* File is decompressed as a stream instead of mapped */
+    cutfile_stream stream; /* Opened by cutfile_read_headers(), continues from the data for cutfile_convert() */
     jibal_element *element; /* parsed element (in telescope), contains all isotopes with relevant concentrations */
     jibal_element *element_sample; /* element (in sample)  */
     efficiencyfile *ef;
+    const foil_table *ft; /* Shared by cutfiles of the same element and mass, owned by tofe_files_convert() */
 } cutfile;
 
+typedef struct tofe_buffer { /* Output of one cutfile, cutfiles are converted in parallel and output in order */
+    char *data;
+    size_t len;
+    size_t size;
+} tofe_buffer;
+
+typedef struct tofe_event { /* Converted event, in SI units */
+    double angle1;
+    double angle2;
+    double energy;
+    int Z; /* Element in sample */
+    double mass;
+    scatter_type type;
+    double weight;
+    int evnum;
+} tofe_event;
+
+typedef struct tofe_events { /* Events of one cutfile, when they are not output as text */
+    tofe_event *event;
+    size_t n;
+    size_t size;
+} tofe_events;
+
+typedef struct tofe_sink { /* Receives the converted events of each cutfile, in the order of files */
+    int (*events)(void *data, const cutfile *cutfile, const tofe_event *event, size_t n); /* Non-zero return value is an error */
+    void *data;
+} tofe_sink;
+
 typedef struct list_files {
     cutfile *cutfiles;
     size_t n_files;
+    efficiency_cache eff_cache;
 } list_files;
 
 typedef enum {
@@ -77,20 +155,42 @@ static const jibal_option cutfile_headers[] = {
 void tofe_files_free(list_files *files);
 int cutfile_parse_filename(jibal *jibal, cutfile *cutfile);
 int cutfile_parse_extensions(jibal *jibal, cutfile *cutfile, char **extensions, int n_ext);
+int cutfile_map(cutfile *cutfile);
+void cutfile_unmap(cutfile *cutfile);
 int cutfile_read_headers(cutfile *cutfile);
 void cutfile_reset(cutfile *cutfile);
 void cutfile_free(cutfile *cutfile);
-int cutfile_convert(jibal *jibal, FILE *out, const tofin_file *tofin, const cutfile *cutfile, const jibal_material *foil);
+int cutfile_convert(tofe_buffer *out, tofe_events *events, const tofin_file *tofin, cutfile *cutfile);
+double tofelist_stop(jibal_gsto *workspace, int Z1, double mass, const jibal_material *target, double E);
+double tofelist_foil_energy(jibal_gsto *workspace, int Z1, double mass, const jibal_material *foil, double thickness, double E);
+foil_table *foil_table_create(jibal_gsto *workspace, int Z1, double mass, const jibal_material *foil, double thickness, double E_max);
+double foil_table_energy(const foil_table *ft, double E);
+void foil_table_free(foil_table *ft);
+int tofe_buffer_reserve(tofe_buffer *buf, size_t n);
+int tofe_buffer_printf(tofe_buffer *buf, const char *restrict format, ...);
+int tofe_buffer_event_line(tofe_buffer *buf, double angle1, double angle2, double energy, int Z, double mass, const char *type_str, double weight, int evnum);
+void tofe_buffer_free(tofe_buffer *buf);
+int tofe_events_add(tofe_events *events, const tofe_event *event);
+void tofe_events_free(tofe_events *events);
 list_files *tofe_files_from_argv(jibal *jibal, const tofin_file *tofin, int argc, char **argv);
 char *tofe_basename(const char *path);
 void tofe_files_print(list_files *files);
 int tofe_files_assign_stopping(jibal *jibal, const list_files *files, const jibal_material *foil);
-int tofe_files_convert(jibal *jibal, const tofin_file *tofin, list_files *files, const jibal_material *foil);
-double energy_from_tof(const tofin_file *tofin, int ch, double mass);
+jibal_material *tofe_files_stopping(jibal *jibal, tofin_file *tofin, const list_files *files);
+int tofe_files_convert(jibal *jibal, const tofin_file *tofin, list_files *files, const jibal_material *foil, const tofe_sink *sink);
+double energy_from_tof(const tofin_file *tofin, int ch, double mass, double dither);
+uint64_t tofe_random_key(uint64_t seed, const char *name);
+double tofe_random(uint64_t key, uint64_t counter);
 efficiencyfile *efficiencyfile_load(const char *filename, int *error_out);
 void efficiencyfile_free(efficiencyfile *ef);
+void efficiencyfile_release(efficiencyfile *ef);
+efficiencyfile *efficiency_cache_get(efficiency_cache *cache, const char *filename, int *error_out);
+void efficiency_cache_free(efficiency_cache *cache);
 int efficiencyfile_points_realloc(efficiencyfile *ef, size_t n_points);
-double efficiencyfile_get_weight(efficiencyfile *ef, double E);
+int efficiencyfile_index_build(efficiencyfile *ef);
+int efficiencyfile_in_range(const efficiencyfile *ef, double E);
+double efficiencyfile_get_weight(const efficiencyfile *ef, double E);
+double efficiencyfile_get_weight_exact(const efficiencyfile *ef, double E);
 char *cutfile_efficiencyfile_name(const cutfile *cutfile, const tofin_file *tofin);
-int cutfile_load_efficiencyfile(cutfile *cutfile, const tofin_file *tofin);
+int cutfile_load_efficiencyfile(cutfile *cutfile, const tofin_file *tofin, efficiency_cache *cache);
 #endif //TOFE_LIST_H
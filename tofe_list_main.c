@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <jibal.h>
+#include <jibal_gsto.h>
+#include "erd_depth_config.h"
+#include "message.h"
+#include "tof_in.h"
+#include "tofe_list.h"
+
+int main(int argc, char **argv) {
+    tofe_list_msg(TOFE_LIST_INFO, "tofe_list (erd_depth) version %s", ERD_DEPTH_VERSION);
+#ifdef DEBUG
+    for(int i = 0; i < argc; i++) {
+        fprintf(stderr, "tofe_list argv[%i] = %s\n", i, argv[i]);
+    }
+#endif
+    FILE *summary_file = NULL;
+    if(argc > 1 && strncmp(argv[1], TOFE_LIST_SUMMARY_OPTION, strlen(TOFE_LIST_SUMMARY_OPTION)) == 0) {
+        const char *summary_filename = argv[1] + strlen(TOFE_LIST_SUMMARY_OPTION);
+        summary_file = fopen(summary_filename, "w");
+        if(!summary_file) {
+            tofe_list_msg(TOFE_LIST_ERROR, "Could not open summary file \"%s\" for writing.", summary_filename);
+            return EXIT_FAILURE;
+        }
+        tofe_list_msg_summary_file(summary_file);
+        argc--;
+        argv++;
+    }
+    if(argc < 3) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Not enough arguments. Usage: tofe_list [%s<summary file>] <tof.in file> <cutfile1> <cutfile2> ...", TOFE_LIST_SUMMARY_OPTION);
+        return EXIT_FAILURE;
+    }
+    jibal *jibal = jibal_init(NULL);
+    if(!jibal) {
+        tofe_list_msg(TOFE_LIST_ERROR, "JIBAL initialization by tofe_list failed.");
+        return EXIT_FAILURE;
+    }
+    argc--;
+    argv++;
+    tofin_file *tofin = tofin_file_load(argv[0]);
+    if(!tofin) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Could not load or parse settings file \"%s\".", argv[0]);
+        return EXIT_FAILURE;
+    }
+    argc--;
+    argv++;
+    list_files *files = tofe_files_from_argv(jibal, tofin, argc, argv);
+    if(!files) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Error in reading cutfiles.");
+        return EXIT_FAILURE;
+    }
+    tofe_files_print(files);
+    jibal_material *foil = tofe_files_stopping(jibal, tofin, files);
+    if(!foil) {
+        return EXIT_FAILURE;
+    }
+    jibal_gsto_print_assignments(jibal->gsto);
+    tofe_list_msg(TOFE_LIST_INFO, "Starting conversion of %zu cutfiles.", files->n_files);
+    int error = tofe_files_convert(jibal, tofin, files, foil, NULL);
+    jibal_material_free(foil);
+    tofe_files_free(files);
+    tofin_file_free(tofin);
+    jibal_free(jibal);
+    if(summary_file) {
+        tofe_list_msg_summary_file(NULL);
+        fclose(summary_file);
+    }
+    if(error) {
+        tofe_list_msg(TOFE_LIST_ERROR, "Conversion of cutfiles failed.");
+        return EXIT_FAILURE;
+    }
+    tofe_list_msg(TOFE_LIST_INFO, "Clean exit from tofe_list. Have a nice day.");
+    return EXIT_SUCCESS;
+}